@@ -11,9 +11,19 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// n_threads
+int n_threads();
+RcppExport SEXP _stranger_n_threads() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(n_threads());
+    return rcpp_result_gen;
+END_RCPP
+}
 // transition
-arma::cube transition(arma::cube N, arma::cube E, arma::mat alpha, arma::cube beta, arma::cube gamma, bool rand, int seed);
-RcppExport SEXP _stranger_transition(SEXP NSEXP, SEXP ESEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP randSEXP, SEXP seedSEXP) {
+arma::cube transition(arma::cube N, arma::cube E, arma::mat alpha, arma::cube beta, arma::cube gamma, bool rand, int seed, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms);
+RcppExport SEXP _stranger_transition(SEXP NSEXP, SEXP ESEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP linkSEXP, SEXP termsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -24,7 +34,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::cube >::type gamma(gammaSEXP);
     Rcpp::traits::input_parameter< bool >::type rand(randSEXP);
     Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(transition(N, E, alpha, beta, gamma, rand, seed));
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    rcpp_result_gen = Rcpp::wrap(transition(N, E, alpha, beta, gamma, rand, seed, link, terms));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -40,6 +52,25 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// lambda_grid
+Rcpp::List lambda_grid(arma::cube E, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, bool stable, bool sensitivity, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms);
+RcppExport SEXP _stranger_lambda_grid(SEXP ESEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP stableSEXP, SEXP sensitivitySEXP, SEXP linkSEXP, SEXP termsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::cube >::type E(ESEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< bool >::type stable(stableSEXP);
+    Rcpp::traits::input_parameter< bool >::type sensitivity(sensitivitySEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    rcpp_result_gen = Rcpp::wrap(lambda_grid(E, alpha, beta, gamma, fecundity, stable, sensitivity, link, terms));
+    return rcpp_result_gen;
+END_RCPP
+}
 // disperse
 arma::mat disperse(arma::mat S, arma::mat N, bool reflect, bool rand, int seed);
 RcppExport SEXP _stranger_disperse(SEXP SSEXP, SEXP NSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP) {
@@ -55,9 +86,52 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// decode_output
+arma::cube decode_output(Rcpp::RawVector data, arma::uword n_rows, arma::uword n_cols, int encoding, double tol);
+RcppExport SEXP _stranger_decode_output(SEXP dataSEXP, SEXP n_rowsSEXP, SEXP n_colsSEXP, SEXP encodingSEXP, SEXP tolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type data(dataSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type n_rows(n_rowsSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type n_cols(n_colsSEXP);
+    Rcpp::traits::input_parameter< int >::type encoding(encodingSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    rcpp_result_gen = Rcpp::wrap(decode_output(data, n_rows, n_cols, encoding, tol));
+    return rcpp_result_gen;
+END_RCPP
+}
 // sim
-arma::cube sim(arma::cube N, arma::field<arma::cube> env, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, arma::mat nb, bool reflect, bool rand, int seed, int record, arma::uword nsteps);
-RcppExport SEXP _stranger_sim(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP recordSEXP, SEXP nstepsSEXP) {
+SEXP sim(arma::cube N, arma::field<arma::cube> env, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, arma::mat nb, bool reflect, bool rand, int seed, int record, arma::uword nsteps, Rcpp::List events, bool numa, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms, int encoding, double tol);
+RcppExport SEXP _stranger_sim(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP recordSEXP, SEXP nstepsSEXP, SEXP eventsSEXP, SEXP numaSEXP, SEXP linkSEXP, SEXP termsSEXP, SEXP encodingSEXP, SEXP tolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::cube >::type N(NSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type env(envSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type nb(nbSEXP);
+    Rcpp::traits::input_parameter< bool >::type reflect(reflectSEXP);
+    Rcpp::traits::input_parameter< bool >::type rand(randSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type record(recordSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type events(eventsSEXP);
+    Rcpp::traits::input_parameter< bool >::type numa(numaSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    Rcpp::traits::input_parameter< int >::type encoding(encodingSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim(N, env, alpha, beta, gamma, fecundity, nb, reflect, rand, seed, record, nsteps, events, numa, link, terms, encoding, tol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_async
+SEXP sim_async(arma::cube N, arma::field<arma::cube> env, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, arma::mat nb, bool reflect, bool rand, int seed, int record, arma::uword nsteps, Rcpp::List events, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms);
+RcppExport SEXP _stranger_sim_async(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP recordSEXP, SEXP nstepsSEXP, SEXP eventsSEXP, SEXP linkSEXP, SEXP termsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -73,16 +147,155 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
     Rcpp::traits::input_parameter< int >::type record(recordSEXP);
     Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
-    rcpp_result_gen = Rcpp::wrap(sim(N, env, alpha, beta, gamma, fecundity, nb, reflect, rand, seed, record, nsteps));
+    Rcpp::traits::input_parameter< Rcpp::List >::type events(eventsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_async(N, env, alpha, beta, gamma, fecundity, nb, reflect, rand, seed, record, nsteps, events, link, terms));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_poll
+Rcpp::List sim_poll(SEXP job);
+RcppExport SEXP _stranger_sim_poll(SEXP jobSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type job(jobSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_poll(job));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_cancel
+void sim_cancel(SEXP job);
+RcppExport SEXP _stranger_sim_cancel(SEXP jobSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type job(jobSEXP);
+    sim_cancel(job);
+    return R_NilValue;
+END_RCPP
+}
+// sim_wait
+arma::cube sim_wait(SEXP job);
+RcppExport SEXP _stranger_sim_wait(SEXP jobSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type job(jobSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_wait(job));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_file
+std::string sim_file(SEXP N, Rcpp::List env, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, arma::mat nb, std::string path, bool reflect, bool rand, int seed, int record, arma::uword nsteps, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms, int encoding, double tol);
+RcppExport SEXP _stranger_sim_file(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP pathSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP recordSEXP, SEXP nstepsSEXP, SEXP linkSEXP, SEXP termsSEXP, SEXP encodingSEXP, SEXP tolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type N(NSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type env(envSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type nb(nbSEXP);
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< bool >::type reflect(reflectSEXP);
+    Rcpp::traits::input_parameter< bool >::type rand(randSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type record(recordSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    Rcpp::traits::input_parameter< int >::type encoding(encodingSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_file(N, env, alpha, beta, gamma, fecundity, nb, path, reflect, rand, seed, record, nsteps, link, terms, encoding, tol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_community
+arma::field<arma::cube> sim_community(arma::field<arma::cube> N, arma::field<arma::cube> env, arma::field<arma::mat> alpha, arma::field<arma::cube> beta, arma::field<arma::cube> gamma, arma::field<arma::vec> fecundity, arma::field<arma::mat> nb, arma::uvec record, bool reflect, bool rand, int seed, arma::uword nsteps);
+RcppExport SEXP _stranger_sim_community(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP recordSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP nstepsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type N(NSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type env(envSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::mat> >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::vec> >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::mat> >::type nb(nbSEXP);
+    Rcpp::traits::input_parameter< arma::uvec >::type record(recordSEXP);
+    Rcpp::traits::input_parameter< bool >::type reflect(reflectSEXP);
+    Rcpp::traits::input_parameter< bool >::type rand(randSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_community(N, env, alpha, beta, gamma, fecundity, nb, record, reflect, rand, seed, nsteps));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_batch
+arma::field<arma::cube> sim_batch(arma::field<arma::cube> N, Rcpp::List env, arma::mat alpha, arma::cube beta, arma::cube gamma, arma::vec fecundity, arma::mat nb, bool reflect, bool rand, int seed, int record, arma::uword nsteps, Rcpp::Nullable<Rcpp::IntegerMatrix> link, Rcpp::Nullable<Rcpp::IntegerMatrix> terms);
+RcppExport SEXP _stranger_sim_batch(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP reflectSEXP, SEXP randSEXP, SEXP seedSEXP, SEXP recordSEXP, SEXP nstepsSEXP, SEXP linkSEXP, SEXP termsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type N(NSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type env(envSEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::cube >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type nb(nbSEXP);
+    Rcpp::traits::input_parameter< bool >::type reflect(reflectSEXP);
+    Rcpp::traits::input_parameter< bool >::type rand(randSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type record(recordSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type link(linkSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type terms(termsSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_batch(N, env, alpha, beta, gamma, fecundity, nb, reflect, rand, seed, record, nsteps, link, terms));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sim_sweep
+arma::field<arma::cube> sim_sweep(arma::cube N, arma::field<arma::cube> env, arma::field<arma::mat> alpha, arma::field<arma::cube> beta, arma::field<arma::cube> gamma, arma::field<arma::vec> fecundity, arma::mat nb, bool reflect, int record, arma::uword nsteps);
+RcppExport SEXP _stranger_sim_sweep(SEXP NSEXP, SEXP envSEXP, SEXP alphaSEXP, SEXP betaSEXP, SEXP gammaSEXP, SEXP fecunditySEXP, SEXP nbSEXP, SEXP reflectSEXP, SEXP recordSEXP, SEXP nstepsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::cube >::type N(NSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type env(envSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::mat> >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::cube> >::type gamma(gammaSEXP);
+    Rcpp::traits::input_parameter< arma::field<arma::vec> >::type fecundity(fecunditySEXP);
+    Rcpp::traits::input_parameter< arma::mat >::type nb(nbSEXP);
+    Rcpp::traits::input_parameter< bool >::type reflect(reflectSEXP);
+    Rcpp::traits::input_parameter< int >::type record(recordSEXP);
+    Rcpp::traits::input_parameter< arma::uword >::type nsteps(nstepsSEXP);
+    rcpp_result_gen = Rcpp::wrap(sim_sweep(N, env, alpha, beta, gamma, fecundity, nb, reflect, record, nsteps));
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_stranger_transition", (DL_FUNC) &_stranger_transition, 7},
+    {"_stranger_n_threads", (DL_FUNC) &_stranger_n_threads, 0},
+    {"_stranger_transition", (DL_FUNC) &_stranger_transition, 9},
     {"_stranger_reproduce", (DL_FUNC) &_stranger_reproduce, 2},
+    {"_stranger_lambda_grid", (DL_FUNC) &_stranger_lambda_grid, 9},
     {"_stranger_disperse", (DL_FUNC) &_stranger_disperse, 5},
-    {"_stranger_sim", (DL_FUNC) &_stranger_sim, 12},
+    {"_stranger_decode_output", (DL_FUNC) &_stranger_decode_output, 5},
+    {"_stranger_sim", (DL_FUNC) &_stranger_sim, 18},
+    {"_stranger_sim_async", (DL_FUNC) &_stranger_sim_async, 15},
+    {"_stranger_sim_poll", (DL_FUNC) &_stranger_sim_poll, 1},
+    {"_stranger_sim_cancel", (DL_FUNC) &_stranger_sim_cancel, 1},
+    {"_stranger_sim_wait", (DL_FUNC) &_stranger_sim_wait, 1},
+    {"_stranger_sim_file", (DL_FUNC) &_stranger_sim_file, 17},
+    {"_stranger_sim_community", (DL_FUNC) &_stranger_sim_community, 12},
+    {"_stranger_sim_batch", (DL_FUNC) &_stranger_sim_batch, 14},
+    {"_stranger_sim_sweep", (DL_FUNC) &_stranger_sim_sweep, 10},
     {NULL, NULL, 0}
 };
 
@@ -1,281 +1,2780 @@
 #include <RcppArmadillo.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace Rcpp;
 
 
+// RANDOM NUMBERS //////////////////////////////////////////////////////////////
+
+// Block random number generator: xoshiro256+ run as L interleaved streams, so
+// that refilling the buffer is a straight loop over lanes that the compiler
+// vectorizes. Samplers draw from the buffer, one generator per thread/engine.
+class BlockRNG {
+public:
+  typedef uint64_t result_type;
+
+  explicit BlockRNG(uint64_t seed, uint64_t stream = 0) : pos(B) {
+    seed += stream * 0xd1b54a32d192ed03ULL; // independent stream per tile
+    for(int l = 0; l < L; ++l) {
+      for(int k = 0; k < 4; ++k) {
+        s[k][l] = splitmix64(seed);
+      }
+    }
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
+
+  result_type operator()() {
+    if (pos == B) {
+      refill();
+    }
+    return buf[pos++];
+  }
+
+  // uniform on [0, 1)
+  double uniform() {
+    return ((*this)() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  static const int L = 8; // interleaved streams
+  static const int B = 512; // buffered draws
+  uint64_t s[4][L];
+  uint64_t buf[B];
+  int pos;
+
+  static uint64_t splitmix64(uint64_t &x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  void refill() {
+    for(int j = 0; j < B; j += L) {
+      for(int l = 0; l < L; ++l) {
+        uint64_t r = s[0][l] + s[3][l];
+        uint64_t t = s[1][l] << 17;
+        s[2][l] ^= s[0][l];
+        s[3][l] ^= s[1][l];
+        s[1][l] ^= s[2][l];
+        s[0][l] ^= s[3][l];
+        s[2][l] ^= t;
+        s[3][l] = (s[3][l] << 45) | (s[3][l] >> 19);
+        buf[j + l] = r;
+      }
+    }
+    pos = 0;
+  }
+};
+
+
+// seed of one kind of draw (0 = transition, 1 = dispersal, 2 = events) at
+// one time step of one run (landscape or species); hashed, so that distinct
+// combinations do not share streams as products like seed * step do
+uint64_t step_seed(uint64_t seed,
+                   uint64_t run,
+                   uint64_t step,
+                   uint64_t draw) {
+  uint64_t v[3] = {run, step, draw};
+  for(int j = 0; j < 3; ++j) {
+    uint64_t z = seed ^ (v[j] + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    seed = z ^ (z >> 31);
+  }
+  return seed;
+}
+
+
+
+// SCHEDULING //////////////////////////////////////////////////////////////////
+
+// The grid is tiled into bands of whole columns (contiguous in memory). Bands
+// are scheduled as OpenMP tasks, which idle threads take from the runtime's
+// task queues; landscapes and species are themselves tasks, so tiles of a busy
+// landscape spread over threads that have finished their own. Bands are at
+// least as wide as the dispersal window, so that bands two apart never write
+// to the same cells. Each band draws from its own random stream, making
+// results independent of the number of threads.
+
+arma::uword band_width(int r) {
+  return std::max<arma::uword>(16, r * 2);
+}
+
+int n_bands(arma::uword ncol, arma::uword w) {
+  return (ncol + w - 1) / w;
+}
+
+
+// threads available to parallel regions, for calibration
+// [[Rcpp::export]]
+int n_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+
+
+// MEMORY //////////////////////////////////////////////////////////////////////
+
+// Large grid buffers are allocated uninitialized and first touched band by
+// band. Placed buffers are touched under the static thread assignment that
+// later transitions them, so that on NUMA systems each band's pages are
+// local to its thread.
+// Buffers above a size threshold also request transparent huge pages, which
+// must happen before the pages are first touched.
+
+const arma::uword huge_min = 1 << 22; // elements (32 MB of doubles)
+
+void advise_huge(double *mem,
+                 arma::uword n) {
+#ifdef MADV_HUGEPAGE
+  if (n < huge_min) {
+    return;
+  }
+  uintptr_t pg = sysconf(_SC_PAGESIZE);
+  uintptr_t a = ((uintptr_t) mem + pg - 1) & ~(pg - 1); // first whole page
+  uintptr_t e = ((uintptr_t) (mem + n)) & ~(pg - 1); // end of last whole page
+  if (e > a) {
+    madvise((void *) a, e - a, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+
+// zero-filled cube whose column bands are first touched in parallel; call
+// outside of any parallel region
+arma::cube placed_cube(arma::uword n_rows,
+                       arma::uword n_cols,
+                       arma::uword n_slices) {
+
+  arma::cube x(n_rows, n_cols, n_slices, arma::fill::none);
+  advise_huge(x.memptr(), x.n_elem);
+
+  arma::uword w = band_width(0);
+  int nband = n_bands(n_cols, w);
+
+  #pragma omp parallel for schedule(static)
+  for(int k = 0; k < nband; ++k) {
+    arma::uword c0 = k * w;
+    arma::uword c1 = std::min(c0 + w, n_cols) - 1;
+    for(arma::uword j = 0; j < n_slices; ++j) {
+      x.slice(j).cols(c0, c1).zeros();
+    }
+  }
+
+  return x;
+}
+
+
+#ifndef _WIN32
+
+// A file mapped into memory, for data too large to keep resident. Pages are
+// read from the file on first access; after a band of the data has been
+// processed its pages are scheduled for write-back and dropped from the
+// process, so that resident memory stays bounded by the bands in flight.
+// Scratch files are unlinked as soon as they are mapped; input files are
+// mapped read-only.
+class MappedFile {
+  int fd;
+  char *base;
+  size_t bytes;
+
+public:
+  MappedFile(const std::string &path, size_t bytes, bool keep = false) :
+    fd(-1), base(NULL), bytes(bytes) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("cannot create file " + path);
+    }
+    if (!keep) {
+      unlink(path.c_str());
+    }
+    if (ftruncate(fd, bytes) != 0) { // sparse: unwritten regions read as zero
+      close(fd);
+      throw std::runtime_error("cannot allocate file " + path);
+    }
+    void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("cannot map file " + path);
+    }
+    base = (char *) m;
+  }
+
+  // existing file, read-only
+  explicit MappedFile(const std::string &path) :
+    fd(-1), base(NULL), bytes(0) {
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error("cannot read file " + path);
+    }
+    bytes = st.st_size;
+    void *m = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("cannot map file " + path);
+    }
+    base = (char *) m;
+  }
+
+  ~MappedFile() {
+    if (base) {
+      munmap(base, bytes);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  char *data() {
+    return base;
+  }
+
+  size_t size() const {
+    return bytes;
+  }
+
+  // write back and drop the pages spanning [from, to)
+  void release(const void *from, const void *to) {
+    advise(from, to, true);
+  }
+
+  // start reading the pages spanning [from, to)
+  void prefetch(const void *from, const void *to) {
+    advise(from, to, false);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+  // round outward to whole pages within the mapping; dropping pages of a
+  // shared mapping keeps their contents, so overlap with neighboring bands
+  // is harmless
+  void advise(const void *from, const void *to, bool drop) {
+    uintptr_t pg = sysconf(_SC_PAGESIZE);
+    uintptr_t a = (uintptr_t) from & ~(pg - 1);
+    uintptr_t e = ((uintptr_t) to + pg - 1) & ~(pg - 1);
+    e = std::min(e, ((uintptr_t) base + bytes + pg - 1) & ~(pg - 1));
+    if (drop) {
+      msync((void *) a, e - a, MS_ASYNC);
+      madvise((void *) a, e - a, MADV_DONTNEED);
+    } else {
+      madvise((void *) a, e - a, MADV_WILLNEED);
+    }
+  }
+};
+
+
+// cube held in a memory-mapped file
+class MappedCube : public MappedFile {
+public:
+  arma::cube x;
+
+  MappedCube(const std::string &path,
+             arma::uword n_rows,
+             arma::uword n_cols,
+             arma::uword n_slices) :
+    MappedFile(path, sizeof(double) * n_rows * n_cols * n_slices),
+    x((double *) data(), n_rows, n_cols, n_slices, false, true) {}
+
+  // write back and drop columns c0..c1 of all slices
+  void release(arma::uword c0, arma::uword c1) {
+    for(arma::uword j = 0; j < x.n_slices; ++j) {
+      MappedFile::release(x.slice(j).colptr(c0), x.slice(j).colptr(c1) + x.n_rows);
+    }
+  }
+
+  // start reading columns c0..c1 of all slices
+  void prefetch(arma::uword c0, arma::uword c1) {
+    for(arma::uword j = 0; j < x.n_slices; ++j) {
+      MappedFile::prefetch(x.slice(j).colptr(c0), x.slice(j).colptr(c1) + x.n_rows);
+    }
+  }
+};
+
+#endif
+
+
+// INPUT CHECKS ////////////////////////////////////////////////////////////////
+
+// Exported functions check their inputs before entering a parallel region:
+// an exception thrown inside one terminates the R session instead of
+// returning an error.
+
+// parameters for n classes, nd density modifiers, and ng environmental
+// effects (variables followed by derived terms)
+void check_demography(const arma::mat &alpha,
+                      const arma::cube &beta,
+                      const arma::cube &gamma,
+                      arma::uword n,
+                      arma::uword nd,
+                      arma::uword ng) {
+  if (alpha.n_rows != n || alpha.n_cols != n) {
+    Rcpp::stop("alpha must be a square matrix with one row and column per class");
+  }
+  if (beta.n_rows != n || beta.n_cols != n || beta.n_slices != nd) {
+    Rcpp::stop("beta must have dimensions (class, class, modifier)");
+  }
+  if (gamma.n_rows != n || gamma.n_cols != n || gamma.n_slices != ng) {
+    Rcpp::stop("gamma must have dimensions (class, class, variable)");
+  }
+}
+
+
+void check_fecundity(const arma::vec &fecundity,
+                     arma::uword n) {
+  if (fecundity.n_elem != n) {
+    Rcpp::stop("fecundity must have one value per class");
+  }
+}
+
+
+// one environmental layer on the nr x nc grid, with ne variables
+void check_layer(const arma::cube &E,
+                 arma::uword nr,
+                 arma::uword nc,
+                 arma::uword ne) {
+  if (E.n_rows != nr || E.n_cols != nc) {
+    Rcpp::stop("environmental data must match the spatial grid of N");
+  }
+  if (E.n_slices != ne) {
+    Rcpp::stop("every element of env must hold the same variables");
+  }
+}
+
+
+// environmental data for nsteps: one element, or one per step
+void check_env(const arma::field<arma::cube> &env,
+               arma::uword nr,
+               arma::uword nc,
+               arma::uword nsteps) {
+  if (env.n_elem == 0 || (env.n_elem > 1 && env.n_elem < nsteps)) {
+    Rcpp::stop("env must have one element, or one per time step");
+  }
+  for(arma::uword j = 0; j < env.n_elem; ++j) {
+    check_layer(env(j), nr, nc, env(0).n_slices);
+  }
+}
+
+
+// square neighborhood matrix with an odd number of rows
+void check_neighborhood(const arma::mat &nb) {
+  if (nb.n_rows != nb.n_cols || nb.n_rows % 2 == 0) {
+    Rcpp::stop("nb must be a square matrix with an odd number of rows");
+  }
+}
+
+
+void check_record(int record,
+                  arma::uword n) {
+  if (record < 0 || record >= (int) n) {
+    Rcpp::stop("record must be the index (0-based) of a class in N");
+  }
+}
+
+
+// checks shared by the single-species simulations
+void check_sim(const arma::cube &N,
+               const arma::field<arma::cube> &env,
+               const arma::mat &alpha,
+               const arma::cube &beta,
+               const arma::cube &gamma,
+               const arma::vec &fecundity,
+               const arma::mat &nb,
+               const arma::umat &terms,
+               int record,
+               arma::uword nsteps) {
+  check_env(env, N.n_rows, N.n_cols, nsteps);
+  check_demography(alpha, beta, gamma, N.n_slices, N.n_slices, env(0).n_slices + terms.n_rows);
+  check_fecundity(fecundity, N.n_slices);
+  check_neighborhood(nb);
+  check_record(record, N.n_slices);
+}
+
+
 // DEMOGRAPHY //////////////////////////////////////////////////////////////////
 
 arma::imat rbinom_trans(arma::imat n,
                         arma::mat p,
-                        std::default_random_engine gen) {
+                        BlockRNG &gen) {
   arma::imat y(n.n_rows, n.n_cols);
   for(arma::uword i = 0; i < n.n_elem; ++i) {
     std::binomial_distribution<> d(n(i), p(i));
     y(i) = d(gen);
   }
-  return y;
+  return y;
+}
+
+
+// multinomial transition of a source class, as a chain of conditional
+// binomials per cell. Targets are visited in descending order of their
+// probability over the grid, so that most individuals are placed by the first
+// draws; each cell carries the probability mass of its remaining targets and
+// mortality down the chain, and stops drawing once all of its individuals
+// are allocated, so the cost follows the number of individuals rather than
+// the size of the grid
+arma::icube rmultinom_trans(const arma::mat &pop,
+                            const arma::cube &probs,
+                            BlockRNG &gen) {
+
+  arma::icube y(size(probs), arma::fill::zeros);
+  arma::vec total(probs.n_slices);
+  for(arma::uword t = 0; t < probs.n_slices; ++t) {
+    total(t) = accu(probs.slice(t));
+  }
+  arma::uvec order = arma::sort_index(total, "descend");
+  arma::uword nt = accu(total > 0); // targets with any probability
+
+  // probabilities differ between cells, so a prepared distribution cannot be
+  // shared; small counts are drawn as Bernoulli sums instead, which need no
+  // setup at all
+  const int small = 16;
+  std::binomial_distribution<> d;
+  typedef std::binomial_distribution<>::param_type param;
+  for(arma::uword i = 0; i < pop.n_elem; ++i) {
+    int u = pop(i); // unallocated
+    double r = 1; // remaining mass: later targets and mortality
+    for(arma::uword j = 0; j < nt && u > 0; ++j) {
+      arma::uword t = order(j);
+      double p = probs[i + t * pop.n_elem];
+      if (p <= 0) {
+        continue;
+      }
+      int k = 0;
+      if (p >= r) {
+        k = u;
+      } else if (u <= small) {
+        double q = p / r;
+        for(int m = 0; m < u; ++m) {
+          k += gen.uniform() < q;
+        }
+      } else {
+        k = d(gen, param(u, p / r));
+      }
+      y[i + t * pop.n_elem] = k;
+      u -= k;
+      r -= p;
+    }
+  }
+
+  return(y);
+}
+
+
+// binomial draws with the same probability p in every cell. Cells with many
+// trials reuse the prepared parameters of their count, set up once per
+// distinct count; cells with few trials are
+// flattened into a single Bernoulli stream, and successes (or failures, when
+// p > 0.5) are located by geometric skipping, so the cost of the stream
+// follows the number of rarer outcomes rather than the number of trials
+arma::imat rbinom_const(const arma::imat &n,
+                        double p,
+                        BlockRNG &gen) {
+
+  arma::imat y(size(n), arma::fill::zeros);
+  if (p <= 0) {
+    return y;
+  }
+  if (p >= 1) {
+    return n;
+  }
+
+  bool flip = p > 0.5;
+  double q = flip ? 1 - p : p;
+  const int small = 16; // largest per-cell count sampled through the stream
+
+  std::binomial_distribution<> d;
+  typedef std::binomial_distribution<>::param_type param;
+  std::unordered_map<int, param> prepared; // by count
+  long total = 0; // trials in the flattened stream
+  for(arma::uword i = 0; i < n.n_elem; ++i) {
+    if (n(i) > small) {
+      auto it = prepared.find(n(i));
+      if (it == prepared.end()) {
+        it = prepared.emplace(n(i), param(n(i), q)).first;
+      }
+      y(i) = d(gen, it->second);
+    } else if (n(i) > 0) {
+      total += n(i);
+    }
+  }
+
+  if (total > 0) {
+    double lq = std::log1p(-q);
+    long pos = -1; // position of the latest rare outcome in the stream
+    long start = 0; // stream position at which cell i begins
+    arma::uword i = 0;
+    while (true) {
+      double skip = std::floor(std::log(1 - gen.uniform()) / lq);
+      if (pos + 1 + skip >= total) {
+        break;
+      }
+      pos += 1 + (long) skip;
+      while (n(i) > small || n(i) <= 0 || start + n(i) <= pos) {
+        if (n(i) > 0 && n(i) <= small) {
+          start += n(i);
+        }
+        ++i;
+      }
+      ++y(i);
+    }
+  }
+
+  if (flip) {
+    y = n - y;
+  }
+  return y;
+}
+
+
+// multinomial transition of a source class whose transition probabilities are
+// the same in every cell, visiting targets in descending order of probability
+arma::icube rmultinom_trans_const(const arma::mat &pop,
+                                  const arma::vec &probs,
+                                  BlockRNG &gen) {
+
+  arma::imat u = arma::conv_to<arma::imat>::from(pop); // unallocated
+  arma::icube y(pop.n_rows, pop.n_cols, probs.n_elem, arma::fill::zeros);
+  arma::uvec order = arma::sort_index(probs, "descend");
+  double r = 1; // remaining mass: later targets and mortality
+
+  for(arma::uword j = 0; j < probs.n_elem && probs(order(j)) > 0; ++j) {
+    arma::uword i = order(j);
+    y.slice(i) = arma::min(rbinom_const(u, probs(i) >= r ? 1 : probs(i) / r, gen), u);
+    u = u - y.slice(i);
+    r -= probs(i);
+    if (!any(vectorise(u))) {
+      break; // all allocated
+    }
+  }
+
+  return(y);
+}
+
+
+
+// inverse link functions, mapping linear predictors to transition
+// probabilities: 0 = identity, 1 = logit, 2 = log
+template <typename T>
+T inverse_link(const T &eta, int link) {
+  switch(link) {
+  case 1:
+    return 1 / (1 + exp(-eta));
+  case 2:
+    return exp(eta);
+  default:
+    return eta;
+  }
+}
+
+
+// optional link codes (to, from), checked against alpha
+arma::imat parse_link(Rcpp::Nullable<Rcpp::IntegerMatrix> link,
+                      const arma::mat &alpha) {
+  if (link.isNull()) {
+    return arma::imat();
+  }
+  arma::imat y = Rcpp::as<arma::imat>(link.get());
+  if (arma::size(y) != arma::size(alpha) || y.min() < 0 || y.max() > 2) {
+    Rcpp::stop("link must be a matrix of codes 0-2 with the dimensions of alpha");
+  }
+  return y;
+}
+
+
+// optional derived environmental terms, one row of two 1-based variable
+// indices per term, whose effects follow the variables' effects in gamma
+arma::umat parse_terms(Rcpp::Nullable<Rcpp::IntegerMatrix> terms,
+                       arma::uword n_env,
+                       const arma::cube &gamma) {
+  if (terms.isNull()) {
+    return arma::umat();
+  }
+  arma::imat y = Rcpp::as<arma::imat>(terms.get());
+  if (y.n_cols != 2 || y.min() < 1 || y.max() > (int) n_env) {
+    Rcpp::stop("terms must be a two-column matrix of environmental variable indices");
+  }
+  if (gamma.n_slices != n_env + y.n_rows) {
+    Rcpp::stop("gamma must have one slice per environmental variable and derived term");
+  }
+  return arma::conv_to<arma::umat>::from(y - 1);
+}
+
+
+// deterministic transition, applying each cell's projection matrix (to, from)
+// to its stage vector; cells are gathered a column at a time, so that each
+// class layer of N, D, and E is read once and each layer of the result
+// written once
+arma::cube transition_cells(const arma::cube &N,
+                            const arma::cube &D,
+                            const arma::cube &E,
+                            const arma::mat &alpha,
+                            const arma::cube &beta,
+                            const arma::cube &gamma,
+                            const arma::imat &link,
+                            const arma::umat &terms) {
+
+  arma::uword n = alpha.n_rows, nr = N.n_rows;
+  arma::cube NN(size(N), arma::fill::none);
+
+  // transitions with any nonzero coefficient; others are structurally absent
+  arma::umat live(n, n);
+  for(arma::uword s = 0; s < n; ++s) {
+    for(arma::uword t = 0; t < n; ++t) {
+      live(t, s) = std::fabs(alpha(t, s)) + accu(abs(beta.tube(t, s))) + accu(abs(gamma.tube(t, s))) != 0;
+    }
+  }
+
+  // modifiers, variables, and derived terms with any effect
+  std::vector<arma::uword> bd, ge, gq;
+  for(arma::uword d = 0; d < D.n_slices; ++d) {
+    if (any(vectorise(beta.slice(d)))) {
+      bd.push_back(d);
+    }
+  }
+  for(arma::uword e = 0; e < E.n_slices; ++e) {
+    if (any(vectorise(gamma.slice(e)))) {
+      ge.push_back(e);
+    }
+  }
+  for(arma::uword q = 0; q < terms.n_rows; ++q) {
+    if (any(vectorise(gamma.slice(E.n_slices + q)))) {
+      gq.push_back(q);
+    }
+  }
+
+  arma::mat Nc(nr, n), Dc(nr, D.n_slices), Ec(nr, E.n_slices), Y(nr, n);
+  arma::mat P(n, n);
+
+  for(arma::uword y = 0; y < N.n_cols; ++y) {
+
+    for(arma::uword k = 0; k < n; ++k) {
+      Nc.col(k) = N.slice(k).col(y);
+    }
+    for(arma::uword d : bd) {
+      Dc.col(d) = D.slice(d).col(y);
+    }
+    for(arma::uword e = 0; e < E.n_slices; ++e) {
+      Ec.col(e) = E.slice(e).col(y);
+    }
+
+    for(arma::uword x = 0; x < nr; ++x) {
+
+      bool empty = true;
+      for(arma::uword s = 0; s < n; ++s) {
+        if (Nc(x, s) != 0) {
+          empty = false;
+          break;
+        }
+      }
+      if (empty) {
+        Y.row(x).zeros();
+        continue;
+      }
+
+      // linear predictors
+      P = alpha;
+      for(arma::uword d : bd) {
+        P += beta.slice(d) * Dc(x, d);
+      }
+      for(arma::uword e : ge) {
+        P += gamma.slice(e) * Ec(x, e);
+      }
+      for(arma::uword q : gq) {
+        P += gamma.slice(E.n_slices + q) * (Ec(x, terms(q, 0)) * Ec(x, terms(q, 1)));
+      }
+
+      // probabilities, constrained individually and jointly as in transition_tile
+      for(arma::uword s = 0; s < n; ++s) {
+        double ps = 0;
+        for(arma::uword t = 0; t < n; ++t) {
+          double v = 0;
+          if (live(t, s)) {
+            v = link.is_empty() ? P(t, s) : inverse_link(P(t, s), link(t, s));
+            v = std::min(std::max(v, 0.0), 1.0);
+          }
+          P(t, s) = v;
+          ps += v;
+        }
+        if (ps > 1) {
+          P.col(s) /= ps;
+        }
+      }
+
+      for(arma::uword t = 0; t < n; ++t) {
+        double v = 0;
+        for(arma::uword s = 0; s < n; ++s) {
+          v += P(t, s) * Nc(x, s);
+        }
+        Y(x, t) = v;
+      }
+    }
+
+    for(arma::uword k = 0; k < n; ++k) {
+      NN.slice(k).col(y) = Y.col(k);
+    }
+  }
+
+  return NN;
+}
+
+
+// transition of the classes in N, with density dependence driven by the
+// (possibly larger) set of classes in D, e.g. all species in a community;
+// deterministic transitions go through transition_cells
+arma::cube transition_tile(const arma::cube &N,
+                           const arma::cube &D,
+                           const arma::cube &E,
+                           const arma::mat &alpha,
+                           const arma::cube &beta,
+                           const arma::cube &gamma,
+                           bool rand,
+                           uint64_t seed,
+                           int tile,
+                           const arma::imat &link = arma::imat(),
+                           const arma::umat &terms = arma::umat()) {
+
+  if (!rand) {
+    return transition_cells(N, D, E, alpha, beta, gamma, link, terms);
+  }
+
+  arma::cube NN(size(N), arma::fill::zeros);
+  arma::cube p(size(N), arma::fill::zeros);
+  double m = 0;
+
+  BlockRNG gen(seed, tile); // initialize random number generator
+
+  for(arma::uword s = 0; s < alpha.n_cols; ++s) { // source class
+
+    // transitions from this class that depend on neither density nor
+    // environment have the same probabilities in every cell
+    bool invariant = true;
+    for(arma::uword t = 0; t < alpha.n_rows; ++t) {
+      if (accu(abs(beta.tube(t, s))) + accu(abs(gamma.tube(t, s))) != 0) {
+        invariant = false;
+        break;
+      }
+    }
+
+    if (invariant) {
+      arma::vec pc = alpha.col(s);
+      for(arma::uword t = 0; t < alpha.n_rows; ++t) {
+        if (pc(t) != 0 && !link.is_empty()) {
+          pc(t) = inverse_link(pc(t), link(t, s));
+        }
+      }
+      pc = clamp(pc, 0, 1);
+      if (accu(pc) > 1) {
+        pc = pc / accu(pc);
+      }
+      NN = NN + rmultinom_trans_const(N.slice(s), pc, gen);
+      continue;
+    }
+
+    p.fill(0);
+
+    // construct transition probabilities
+    for(arma::uword t = 0; t < alpha.n_rows; ++t) { // target class
+
+      if (std::fabs(alpha(t, s)) +
+          accu(abs(beta.tube(t, s))) +
+          accu(abs(gamma.tube(t, s))) == 0) {
+        continue;
+      }
+
+      // intercept
+      p.slice(t).fill(alpha(t, s));
+
+      // density dependence
+      for(arma::uword d = 0; d < D.n_slices; ++d){
+        m = beta(t, s, d);
+        if (m != 0) {
+          p.slice(t) = p.slice(t) + arma::conv_to<arma::mat>::from(D.slice(d)) * m;
+        }
+      }
+
+      // environmental dependence
+      for(arma::uword e = 0; e < E.n_slices; ++e){
+        m = gamma(t, s, e);
+        if (m != 0) {
+          p.slice(t) = p.slice(t) + E.slice(e) * m;
+        }
+      }
+
+      // derived terms: squares and interactions of environmental variables
+      for(arma::uword q = 0; q < terms.n_rows; ++q){
+        m = gamma(t, s, E.n_slices + q);
+        if (m != 0) {
+          p.slice(t) = p.slice(t) + (E.slice(terms(q, 0)) % E.slice(terms(q, 1))) * m;
+        }
+      }
+
+      if (!link.is_empty() && link(t, s) != 0) {
+        p.slice(t) = inverse_link<arma::mat>(p.slice(t), link(t, s));
+      }
+
+    }
+
+    // constrain individual and joint probabilities
+    p = clamp(p, 0, 1);
+    arma::mat psum = sum(p, 2);
+    for(arma::uword x = 0; x < psum.n_rows; ++x) {
+      for(arma::uword y = 0; y < psum.n_cols; ++y) {
+        if(psum(x, y) > 1) {
+          p.tube(x, y) = p.tube(x, y) / psum(x, y);
+        }
+      }
+    }
+
+    // perform class transition
+    NN = NN + rmultinom_trans(N.slice(s), p, gen);
+
+  }
+
+  return NN;
+}
+
+
+// transition of band k, columns c0..c1, into NN; bands without individuals
+// are zeroed without drawing
+void transition_band(const arma::cube &N,
+                     const arma::cube &D,
+                     const arma::cube &E,
+                     const arma::mat &alpha,
+                     const arma::cube &beta,
+                     const arma::cube &gamma,
+                     bool rand,
+                     uint64_t seed,
+                     const arma::imat &link,
+                     const arma::umat &terms,
+                     int k,
+                     arma::uword c0,
+                     arma::uword c1,
+                     arma::cube &NN) {
+  if (accu(N.cols(c0, c1)) == 0) {
+    NN.cols(c0, c1).zeros();
+    return;
+  }
+  NN.cols(c0, c1) = transition_tile(N.cols(c0, c1), D.cols(c0, c1), E.cols(c0, c1),
+                                    alpha, beta, gamma, rand, seed, k, link, terms);
+}
+
+
+// transition over the whole grid into NN, which must not alias N or D, one
+// task per band. With placed, the bands are instead split over the threads
+// of a new parallel region with the static schedule of placed_cube, so that
+// each thread works on the pages it first touched; call it outside of any
+// parallel region then
+void transition_into(const arma::cube &N,
+                     const arma::cube &D,
+                     const arma::cube &E,
+                     const arma::mat &alpha,
+                     const arma::cube &beta,
+                     const arma::cube &gamma,
+                     bool rand,
+                     uint64_t seed,
+                     const arma::imat &link,
+                     const arma::umat &terms,
+                     arma::cube &NN,
+                     bool placed = false) {
+
+  arma::uword w = band_width(0);
+  int nband = n_bands(N.n_cols, w);
+
+  if (placed) {
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < nband; ++k) {
+      transition_band(N, D, E, alpha, beta, gamma, rand, seed, link, terms,
+                      k, k * w, std::min((k + 1) * w, N.n_cols) - 1, NN);
+    }
+    return;
+  }
+
+  #pragma omp taskloop default(shared) grainsize(1)
+  for(int k = 0; k < nband; ++k) {
+    transition_band(N, D, E, alpha, beta, gamma, rand, seed, link, terms,
+                    k, k * w, std::min((k + 1) * w, N.n_cols) - 1, NN);
+  }
+}
+
+
+// transition over the whole grid into a new cube
+arma::cube transition_step(const arma::cube &N,
+                           const arma::cube &D,
+                           const arma::cube &E,
+                           const arma::mat &alpha,
+                           const arma::cube &beta,
+                           const arma::cube &gamma,
+                           bool rand,
+                           uint64_t seed,
+                           const arma::imat &link = arma::imat(),
+                           const arma::umat &terms = arma::umat()) {
+  arma::cube NN(size(N), arma::fill::none); // first touched by band tasks
+  advise_huge(NN.memptr(), NN.n_elem);
+  transition_into(N, D, E, alpha, beta, gamma, rand, seed, link, terms, NN);
+  return NN;
+}
+
+
+//' Perform a stage-based demographic transition
+//'
+//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
+//' @param E A 3-D array of environmental data (x, y, variable).
+//' @param alpha A matrix of transition intercepts (to, from).
+//' @param beta A 3-D array of density dependence effects (to, from, modifier).
+//' @param gamma A 3-D array of environmental effects (to, from, variable), followed by the effects of any derived \code{terms}.
+//' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
+//' @param seed Integer to seed random number generator.
+//' @param link Optional integer matrix (to, from) of link functions mapping each transition's linear predictor to
+//' a probability: 0 = identity, 1 = logit, 2 = log. Probabilities are then constrained as usual. Transitions
+//' whose coefficients are all zero remain absent under any link.
+//' @param terms Optional two-column integer matrix of derived environmental terms, one row per term, each the
+//' product of two variables in \code{E} (1-based indices; equal indices give a square). Terms are evaluated as needed,
+//' not stored.
+//' @return A 3-D array of population numbers for each life stage.
+//' @export
+// [[Rcpp::export]]
+arma::cube transition(arma::cube N,
+                      arma::cube E,
+                      arma::mat alpha,
+                      arma::cube beta,
+                      arma::cube gamma,
+                      bool rand = true,
+                      int seed = 1,
+                      Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+                      Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue) {
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, E.n_slices, gamma);
+  check_layer(E, N.n_rows, N.n_cols, E.n_slices);
+  check_demography(alpha, beta, gamma, N.n_slices, N.n_slices, E.n_slices + tm.n_rows);
+  arma::cube NN;
+  #pragma omp parallel
+  #pragma omp single
+  NN = transition_step(N, N, E, alpha, beta, gamma, rand, seed, lk, tm);
+  return NN;
+}
+
+
+//' Reproduction across a spatial grid
+//'
+//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
+//' @param f Integer vector of fecundity with a value for each class in \code{N}.
+//' @return A matrix.
+//' @export
+// [[Rcpp::export]]
+arma::mat reproduce(arma::cube N,
+                    arma::vec f) {
+  arma::mat y(N.n_rows, N.n_cols, arma::fill::zeros);
+
+  for(arma::uword i = 0; i < N.n_slices; ++i){
+    if (f(i) == 0) {
+      continue;
+    }
+    y = y + N.slice(i) * f(i);
+  }
+
+  return(y);
+}
+
+
+// GROWTH RATES ////////////////////////////////////////////////////////////////
+
+// dominant eigenvalue of a nonnegative matrix, which is real and has the
+// largest real part, and its eigenvector w, made nonnegative and normalized
+// to sum to one; false if the eigendecomposition fails
+bool dominant_eigen(const arma::mat &A,
+                    double &lambda,
+                    arma::vec &w) {
+  arma::cx_vec val;
+  arma::cx_mat vec;
+  if (!A.is_finite() || !arma::eig_gen(val, vec, A)) {
+    return false;
+  }
+  arma::uword j = arma::index_max(arma::real(val));
+  lambda = std::real(val(j));
+  w = arma::abs(arma::real(vec.col(j)));
+  double sw = accu(w);
+  if (sw > 0) {
+    w /= sw;
+  }
+  return true;
+}
+
+
+//' Local population growth rates
+//'
+//' Computes the density-independent growth rate of every grid cell from its projection matrix
+//' \code{A = (I + e1 f') T}, where \code{T} holds the transition probabilities given \code{alpha},
+//' \code{gamma}, and the cell's environment (constrained as in \code{transition}), and reproduction adds
+//' the offspring of the post-transition population to the first class, without dispersal. Growth rates
+//' are the dominant eigenvalues of the cells' matrices; cells whose eigendecomposition fails get \code{NaN},
+//' with a warning.
+//'
+//' @param E A 3-D array of environmental data (x, y, variable).
+//' @param alpha A matrix of transition intercepts (to, from).
+//' @param beta A 3-D array of density dependence effects (to, from, modifier). Densities are taken as zero,
+//' but as in \code{transition}, only transitions whose coefficients are all zero are absent.
+//' @param gamma A 3-D array of environmental effects (to, from, variable).
+//' @param fecundity Vector of fecundity with a value for each class.
+//' @param stable Also return the stable stage distribution (Boolean, default = FALSE).
+//' @param sensitivity Also return the sensitivities of lambda to each matrix element (Boolean, default = FALSE).
+//' @param link, \code{terms} Optional link functions and derived environmental terms; see \code{?transition}.
+//' @return A list with \code{lambda}, a matrix (x, y); if requested, \code{stable}, a 3-D array (x, y, class),
+//' and \code{sensitivity}, a 3-D array (x, y, element) with matrix elements in column-major (to, from) order.
+//' @export
+// [[Rcpp::export]]
+Rcpp::List lambda_grid(arma::cube E,
+                       arma::mat alpha,
+                       arma::cube beta,
+                       arma::cube gamma,
+                       arma::vec fecundity,
+                       bool stable = false,
+                       bool sensitivity = false,
+                       Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+                       Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue) {
+
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, E.n_slices, gamma);
+  arma::uword nr = E.n_rows, nc = E.n_cols, n = alpha.n_rows;
+  check_demography(alpha, beta, gamma, n, beta.n_slices, E.n_slices + tm.n_rows);
+  check_fecundity(fecundity, n);
+
+  // transitions with any nonzero coefficient; others stay absent under any link
+  arma::umat live(n, n);
+  for(arma::uword s = 0; s < n; ++s) {
+    for(arma::uword t = 0; t < n; ++t) {
+      live(t, s) = std::fabs(alpha(t, s)) + accu(abs(beta.tube(t, s))) + accu(abs(gamma.tube(t, s))) != 0;
+    }
+  }
+  arma::mat lambda(nr, nc);
+  arma::cube W, S;
+  if (stable) {
+    W.set_size(nr, nc, n);
+  }
+  if (sensitivity) {
+    S.set_size(nr, nc, n * n);
+  }
+
+  arma::uword w = band_width(0);
+  int nband = n_bands(nc, w);
+  int failed = 0; // cells whose eigendecomposition failed
+
+  #pragma omp parallel
+  #pragma omp single
+  #pragma omp taskloop default(shared) grainsize(1)
+  for(int k = 0; k < nband; ++k) {
+    arma::uword c0 = k * w;
+    arma::uword c1 = std::min(c0 + w, nc) - 1;
+    arma::mat T(n, n), A(n, n);
+    arma::vec rw(n), lv(n);
+    double l = 0, lt = 0;
+    for(arma::uword y = c0; y <= c1; ++y) {
+      for(arma::uword x = 0; x < nr; ++x) {
+
+        // transition probabilities, constrained as in transition_tile
+        T = alpha;
+        for(arma::uword e = 0; e < E.n_slices; ++e) {
+          T += gamma.slice(e) * E(x, y, e);
+        }
+        for(arma::uword q = 0; q < tm.n_rows; ++q) {
+          T += gamma.slice(E.n_slices + q) * (E(x, y, tm(q, 0)) * E(x, y, tm(q, 1)));
+        }
+        for(arma::uword i = 0; i < T.n_elem; ++i) {
+          if (!live(i)) {
+            T(i) = 0;
+          } else if (!lk.is_empty() && lk(i) != 0) {
+            T(i) = inverse_link(T(i), lk(i));
+          }
+        }
+        T = clamp(T, 0, 1);
+        for(arma::uword s = 0; s < n; ++s) {
+          double ps = accu(T.col(s));
+          if (ps > 1) {
+            T.col(s) /= ps;
+          }
+        }
+
+        // reproduction after transition, retained in the cell
+        A = T;
+        A.row(0) += fecundity.t() * T;
+
+        bool ok = dominant_eigen(A, l, rw);
+        if (sensitivity && ok) {
+          ok = dominant_eigen(A.t(), lt, lv); // reproductive values
+        }
+        if (!ok) {
+          #pragma omp atomic
+          ++failed;
+          lambda(x, y) = arma::datum::nan;
+          if (stable) {
+            W.tube(x, y).fill(arma::datum::nan);
+          }
+          if (sensitivity) {
+            S.tube(x, y).fill(arma::datum::nan);
+          }
+          continue;
+        }
+        lambda(x, y) = l;
+        if (stable) {
+          W.tube(x, y) = rw;
+        }
+        if (sensitivity) {
+          double vw = dot(lv, rw);
+          arma::mat s = vw > 0 ? arma::mat(lv * rw.t() / vw) : arma::mat(n, n, arma::fill::zeros);
+          S.tube(x, y) = arma::vectorise(s);
+        }
+      }
+    }
+  }
+
+  if (failed > 0) {
+    Rcpp::warning("eigendecomposition failed in %d cells, whose growth rates are NaN", failed);
+  }
+  Rcpp::List y = Rcpp::List::create(Rcpp::Named("lambda") = lambda);
+  if (stable) {
+    y.push_back(Rcpp::wrap(W), "stable");
+  }
+  if (sensitivity) {
+    y.push_back(Rcpp::wrap(S), "sensitivity");
+  }
+  return y;
+}
+
+
+// DISPERSAL ///////////////////////////////////////////////////////////////////
+
+
+int rbinom_disp(int n,
+                double p,
+                BlockRNG &gen) {
+  std::binomial_distribution<> d(n, p);
+  return d(gen);
+}
+
+
+arma::imat rmultinom_disp(int seeds,
+                          arma::mat probs,
+                          arma::uvec ind,
+                          BlockRNG &gen) {
+
+  arma::imat y(size(probs), arma::fill::zeros); // post-dispersal counts
+  double p = 1; // unallocated probability
+  int u = seeds; // unallocated seeds
+  arma::uword ii = 0;
+
+  for(arma::uword i = 0; i < probs.n_elem; ++i) {
+    ii = ind(i);
+    p = accu(probs);
+    y(ii) = std::min(rbinom_disp(u, probs(ii) / p, gen), u);
+    u = u - y(ii);
+    if (u == 0) {
+      break;
+    }
+    probs(ii) = 0;
+  }
+
+  return(y);
+}
+
+
+// scatter the seeds of columns c0..c1 of S into the padded grid T from the
+// random stream of band k, with a precomputed neighbor evaluation order Ni
+void scatter_band(const arma::mat &S,
+                  const arma::mat &N,
+                  const arma::uvec &Ni,
+                  bool rand,
+                  uint64_t seed,
+                  int k,
+                  arma::uword c0,
+                  arma::uword c1,
+                  arma::mat &T) {
+
+  int r = (N.n_rows - 1) / 2; // window radius
+  BlockRNG gen(seed, k); // initialize random number generator
+
+  for(arma::uword b = c0; b <= c1; ++b) {
+    for(arma::uword a = 0; a < S.n_rows; ++a) {
+
+      if (S(a, b) == 0) {
+        continue;
+      }
+
+      if (rand) {
+        T.submat(a, b, a + r * 2, b + r * 2) =
+          T.submat(a, b, a + r * 2, b + r * 2) +
+          rmultinom_disp(S(a, b), N, Ni, gen);
+      } else {
+        T.submat(a, b, a + r * 2, b + r * 2) =
+          T.submat(a, b, a + r * 2, b + r * 2) +
+          S(a, b) * N;
+      }
+
+    }
+  }
+}
+
+
+// Reflection folds the seeds that landed in the padding of T back into the
+// grid: first the padding columns, then the padding rows of each column. The
+// in-memory and out-of-core simulations apply the same sequence, so that
+// their results match.
+void fold_cols(arma::mat &T,
+               int r) {
+  for(int i = 0; i < r; ++i){
+    T.col(r * 2 - 1 - i) += T.col(i);
+    T.col(T.n_cols - (r * 2 - 1 - i) - 1) += T.col(T.n_cols - 1 - i);
+  }
+}
+
+
+// fold the padding rows of columns c0..c1 of T
+void fold_rows(arma::mat &T,
+               int r,
+               arma::uword c0,
+               arma::uword c1) {
+  for(arma::uword j = c0; j <= c1; ++j) {
+    double *t = T.colptr(j);
+    for(int i = 0; i < r; ++i){
+      t[r * 2 - 1 - i] += t[i];
+      t[T.n_rows - (r * 2 - 1 - i) - 1] += t[T.n_rows - 1 - i];
+    }
+  }
+}
+
+
+// dispersal with a precomputed neighbor evaluation order Ni
+arma::mat disperse_step(const arma::mat &S,
+                        const arma::mat &N,
+                        const arma::uvec &Ni,
+                        bool reflect,
+                        bool rand,
+                        uint64_t seed) {
+
+  int r = (N.n_rows - 1) / 2; // window radius
+  arma::mat T(S.n_rows + r * 2, S.n_cols + r * 2, arma::fill::none); // padded grid
+  advise_huge(T.memptr(), T.n_elem);
+
+  // source bands write to overlapping windows only if adjacent, so even and
+  // odd bands are scattered in two phases
+  arma::uword w = band_width(r);
+  int nband = n_bands(S.n_cols, w);
+
+  int nzero = n_bands(T.n_cols, w);
+  #pragma omp taskloop default(shared) grainsize(1)
+  for(int k = 0; k < nzero; ++k) {
+    T.cols(k * w, std::min((k + 1) * w, T.n_cols) - 1).zeros();
+  }
+
+  for(int phase = 0; phase < 2; ++phase) {
+    #pragma omp taskloop default(shared) grainsize(1)
+    for(int k = phase; k < nband; k += 2) {
+      scatter_band(S, N, Ni, rand, seed, k, k * w, std::min((k + 1) * w, S.n_cols) - 1, T);
+    }
+  }
+
+  if (reflect) {
+    fold_cols(T, r);
+    #pragma omp taskloop default(shared) grainsize(1)
+    for(int k = 0; k < nband; ++k) {
+      fold_rows(T, r, k * w + r, std::min((k + 1) * w, S.n_cols) - 1 + r);
+    }
+  }
+
+  return T.submat(r, r, S.n_rows + r - 1, S.n_cols + r - 1);
+}
+
+
+//' Simulate dispersal across a spatial grid
+//'
+//' @param S A matrix of seed counts across a spatial grid.
+//' @param N A neighbor matrix, e.g. produced by \code{neighborhood()}.
+//' @param reflect Should dispersers exit the domain (\code{FALSE}) or bounce off the domain boundary (\code{TRUE}, default)?
+//' @param rand Randomize dispersal? (default = \code{TRUE})
+//' @param seed Integer to seed random number generator.
+//' @return A matrix of post-dispersal seed counts of the same dimension as \code{S}.
+//' @export
+// [[Rcpp::export]]
+arma::mat disperse(arma::mat S,
+                   arma::mat N,
+                   bool reflect = true,
+                   bool rand = true,
+                   int seed = 1) {
+  check_neighborhood(N);
+  arma::uvec Ni = arma::sort_index(N, "descent"); // order to evaluate neighbors
+  arma::mat y;
+  #pragma omp parallel
+  #pragma omp single
+  y = disperse_step(S, N, Ni, reflect, rand, seed);
+  return y;
+}
+
+
+
+// EVENTS //////////////////////////////////////////////////////////////////////
+
+struct Event {
+  arma::uword step; // time step at which the event is applied (1-based)
+  std::string type; // "mask", "alpha", "fecundity", or "habitat"
+  arma::cube mask;
+  arma::mat alpha;
+  arma::vec fecundity;
+  arma::mat habitat;
+};
+
+
+std::vector<Event> parse_events(Rcpp::List events,
+                                arma::cube N,
+                                arma::uword nsteps) {
+
+  std::vector<Event> y;
+
+  for(int i = 0; i < events.size(); ++i) {
+    Rcpp::List ev = events[i];
+    Event e;
+    int step = Rcpp::as<int>(ev["step"]);
+    if (step < 1 || (arma::uword) step > nsteps) {
+      Rcpp::stop("event step must be between 1 and nsteps");
+    }
+    e.step = step;
+    e.type = Rcpp::as<std::string>(ev["type"]);
+    Rcpp::NumericVector v = ev["value"];
+
+    if (e.type == "mask") {
+      if (v.hasAttribute("dim")) {
+        e.mask = Rcpp::as<arma::cube>(v);
+      } else { // one multiplier per class
+        arma::vec m = Rcpp::as<arma::vec>(v);
+        if (m.n_elem != N.n_slices) {
+          Rcpp::stop("mask event vector must have one value per class");
+        }
+        e.mask.set_size(size(N));
+        for(arma::uword k = 0; k < N.n_slices; ++k) {
+          e.mask.slice(k).fill(m(k));
+        }
+      }
+      if (arma::size(e.mask) != arma::size(N)) {
+        Rcpp::stop("mask event dimensions must match N");
+      }
+    } else if (e.type == "alpha") {
+      e.alpha = Rcpp::as<arma::mat>(v);
+      if (e.alpha.n_rows != N.n_slices || e.alpha.n_cols != N.n_slices) {
+        Rcpp::stop("alpha event must be a square matrix with one row and column per class");
+      }
+    } else if (e.type == "fecundity") {
+      e.fecundity = Rcpp::as<arma::vec>(v);
+      if (e.fecundity.n_elem != N.n_slices) {
+        Rcpp::stop("fecundity event must have one value per class");
+      }
+    } else if (e.type == "habitat") {
+      e.habitat = Rcpp::as<arma::mat>(v);
+      if (e.habitat.n_rows != N.n_rows || e.habitat.n_cols != N.n_cols) {
+        Rcpp::stop("habitat event dimensions must match the spatial grid");
+      }
+    } else {
+      Rcpp::stop("unknown event type: " + e.type);
+    }
+
+    y.push_back(e);
+  }
+
+  return(y);
+}
+
+
+// multiply population numbers by a mask; when randomized, each individual
+// contributes floor(m) copies plus one more with probability m - floor(m).
+// N is updated in place, keeping its buffer
+void thin(arma::cube &N,
+          arma::cube m,
+          bool rand,
+          BlockRNG &gen) {
+
+  m = clamp(m, 0, arma::datum::inf);
+  if (!rand) {
+    N %= m;
+    return;
+  }
+
+  arma::cube w = floor(m);
+  for(arma::uword k = 0; k < N.n_slices; ++k) {
+    arma::imat n = arma::conv_to<arma::imat>::from(N.slice(k));
+    N.slice(k) = N.slice(k) % w.slice(k) +
+      arma::conv_to<arma::mat>::from(rbinom_trans(n, m.slice(k) - w.slice(k), gen));
+  }
+}
+
+
+
+// OUTPUT ENCODING /////////////////////////////////////////////////////////////
+
+// half-precision conversions, rounding to nearest even
+uint16_t to_half(double v) {
+  float f = (float) v;
+  uint32_t b;
+  std::memcpy(&b, &f, sizeof(b));
+  uint32_t sign = (b >> 16) & 0x8000;
+  uint32_t a = b & 0x7fffffff;
+  if (a >= 0x477ff000) { // rounds beyond the largest half
+    return sign | (a > 0x7f800000 ? 0x7e00 : 0x7c00);
+  }
+  if (a < 0x38800000) { // half subnormal, in units of 2^-24
+    return sign | (uint16_t) std::nearbyint(std::fabs(f) * 16777216.0f);
+  }
+  a -= 0x38000000; // rebias exponent from 127 to 15
+  return sign | ((a + 0x0fff + ((a >> 13) & 1)) >> 13);
+}
+
+double from_half(uint16_t h) {
+  int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  double v = e == 0 ? std::ldexp(m, -24) :
+    e == 31 ? (m ? NAN : INFINITY) : std::ldexp(m + 1024, e - 25);
+  return h & 0x8000 ? -v : v;
+}
+
+
+// Compact encodings of recorded population numbers:
+// 0 = double;
+// 1 = float16, relative error at most 2^-11 for values of at least 2^-14;
+//     smaller values, which half precision holds only as subnormals with
+//     coarser relative error, are stored as zero;
+// 2 = log-quantized 16-bit, relative error at most tol for values from tol
+//     to at least log16_max; smaller values are rounded to the nearer of
+//     zero and tol, with absolute error at most tol / 2;
+//     error bounds too small to span that range are rejected;
+// 3 = 32-bit integer counts, exact for randomized runs, which alone are
+//     accepted.
+// Values beyond an encoding's range are clamped to it.
+const double log16_max = 1e9;
+
+struct Codec {
+  int type;
+  double tol;
+  double h; // log16 step, in log units
+  double lmin; // log16 value of code 1
+
+  Codec(int type, double tol) : type(type), tol(tol), h(2 * std::log1p(tol)), lmin(std::log(tol)) {
+    if (type < 0 || type > 3) {
+      Rcpp::stop("unknown output encoding");
+    }
+    if (type == 1 && tol < std::ldexp(1.0, -11)) {
+      Rcpp::stop("float16 output cannot meet an error bound below 2^-11");
+    }
+    if (type == 2 && !(tol > 0 && tol < 1)) {
+      Rcpp::stop("log16 output needs an error bound between 0 and 1");
+    }
+    if (type == 2 && lmin + 65534 * h < std::log(log16_max)) {
+      Rcpp::stop("log16 output cannot span values up to 1e9 within this error bound; use a larger tol");
+    }
+  }
+
+  size_t bytes() const {
+    const size_t b[] = {8, 2, 2, 4};
+    return b[type];
+  }
+
+  // encode n values, returning the number clamped to the encodable range
+  arma::uword encode(const double *x, arma::uword n, char *y) const {
+    arma::uword clamped = 0;
+    switch(type) {
+    case 0:
+      std::memcpy(y, x, n * sizeof(double));
+      break;
+    case 1: {
+      uint16_t *q = (uint16_t *) y;
+      const double smallest = std::ldexp(1.0, -14); // smallest normal half
+      for(arma::uword i = 0; i < n; ++i) {
+        if (x[i] > 65504) {
+          q[i] = 0x7bff;
+          ++clamped;
+        } else if (std::fabs(x[i]) < smallest) {
+          q[i] = 0;
+        } else {
+          q[i] = to_half(x[i]);
+        }
+      }
+      break;
+    }
+    case 2: {
+      uint16_t *q = (uint16_t *) y;
+      for(arma::uword i = 0; i < n; ++i) {
+        if (x[i] < tol) { // nearer of zero and tol
+          q[i] = x[i] < tol / 2 ? 0 : 1;
+          continue;
+        }
+        double c = std::nearbyint((std::log(x[i]) - lmin) / h);
+        if (c > 65534) {
+          c = 65534;
+          ++clamped;
+        }
+        q[i] = 1 + (uint16_t) std::max(c, 0.0);
+      }
+      break;
+    }
+    case 3: {
+      int32_t *q = (int32_t *) y;
+      for(arma::uword i = 0; i < n; ++i) {
+        double c = std::nearbyint(x[i]);
+        if (c > INT32_MAX) {
+          c = INT32_MAX;
+          ++clamped;
+        }
+        q[i] = (int32_t) c;
+      }
+      break;
+    }
+    }
+    return clamped;
+  }
+
+  void decode(const char *y, arma::uword n, double *x) const {
+    switch(type) {
+    case 0:
+      std::memcpy(x, y, n * sizeof(double));
+      break;
+    case 1: {
+      const uint16_t *q = (const uint16_t *) y;
+      for(arma::uword i = 0; i < n; ++i) {
+        x[i] = from_half(q[i]);
+      }
+      break;
+    }
+    case 2: {
+      const uint16_t *q = (const uint16_t *) y;
+      for(arma::uword i = 0; i < n; ++i) {
+        x[i] = q[i] == 0 ? 0 : std::exp(lmin + (q[i] - 1) * h);
+      }
+      break;
+    }
+    case 3: {
+      const int32_t *q = (const int32_t *) y;
+      for(arma::uword i = 0; i < n; ++i) {
+        x[i] = q[i];
+      }
+      break;
+    }
+    }
+  }
+};
+
+
+// output recorded in a compact encoding, one grid of values per time step
+struct Encoded {
+  Codec codec;
+  char *data;
+  arma::uword clamped;
+
+  Encoded(const Codec &codec, char *data) : codec(codec), data(data), clamped(0) {}
+
+  void put(arma::uword step, const arma::mat &x) {
+    clamped += codec.encode(x.memptr(), x.n_elem, data + step * x.n_elem * codec.bytes());
+  }
+};
+
+
+// encoded output as an R object, for decode_output()
+Rcpp::List encoded_list(Rcpp::RawVector data,
+                        arma::uword n_rows,
+                        arma::uword n_cols,
+                        arma::uword n_slices,
+                        const Codec &codec) {
+  Rcpp::List y = Rcpp::List::create(Rcpp::Named("data") = data,
+                                    Rcpp::Named("dim") = Rcpp::NumericVector::create(n_rows, n_cols, n_slices),
+                                    Rcpp::Named("encoding") = codec.type,
+                                    Rcpp::Named("tol") = codec.tol);
+  y.attr("class") = "encoded_sim";
+  return y;
+}
+
+
+//' Decode compactly encoded simulation output
+//'
+//' @param data A raw vector of encoded values, as in the \code{data} element of encoded \code{sim} output.
+//' @param n_rows, \code{n_cols} Spatial grid dimensions.
+//' @param encoding Output encoding: 0 = double, 1 = float16, 2 = log16, 3 = integer counts.
+//' @param tol Error bound the output was encoded with.
+//' @return A 3-D array of population numbers (x, y, time).
+//' @export
+// [[Rcpp::export]]
+arma::cube decode_output(Rcpp::RawVector data,
+                         arma::uword n_rows,
+                         arma::uword n_cols,
+                         int encoding = 0,
+                         double tol = 1e-3) {
+  Codec codec(encoding, tol);
+  arma::uword n = n_rows * n_cols;
+  arma::cube y(n_rows, n_cols, data.size() / (n * codec.bytes()));
+  codec.decode((const char *) RAW(data), y.n_elem, y.memptr());
+  return y;
+}
+
+
+// SIMULATION //////////////////////////////////////////////////////////////////
+
+// progress of a running simulation, shared with the R session; reductions
+// for a step are written before the step counter is published
+struct Progress {
+  std::atomic<arma::uword> step; // completed time steps
+  std::atomic<bool> cancel;
+  std::vector<double> total; // individuals of the recorded class, per step
+  std::vector<double> occupied; // cells with recorded individuals, per step
+
+  explicit Progress(arma::uword nsteps) :
+    step(0), cancel(false), total(nsteps + 1), occupied(nsteps + 1) {}
+};
+
+
+// simulation loop shared by the exported entry points, recording into d, which
+// the caller allocates with nsteps + 1 slices; must not touch the R API so that
+// it can run inside parallel regions or background threads. Callers run it
+// inside a parallel region, under single; with numa, it opens its own
+// parallel regions instead, and must be called outside of any
+void sim_core(arma::cube N,
+              const arma::field<arma::cube> &env,
+              arma::mat alpha,
+              const arma::cube &beta,
+              const arma::cube &gamma,
+              const arma::imat &link,
+              const arma::umat &terms,
+              arma::vec fecundity,
+              const arma::mat &nb,
+              const arma::uvec &nbi,
+              const std::vector<Event> &ev,
+              bool reflect,
+              bool rand,
+              int seed,
+              arma::uword run,
+              int record,
+              arma::uword nsteps,
+              arma::cube &d,
+              Progress *progress = NULL,
+              Encoded *enc = NULL,
+              bool numa = false) {
+
+  arma::vec ei(nsteps + 1, arma::fill::zeros);
+  if (env.n_elem > 1) {
+    ei = arma::linspace(0, nsteps, nsteps + 1);
+  }
+
+  arma::cube habitat; // persistent habitat mask, empty if none
+
+  // the state is double-buffered, so that every step writes into pages that
+  // are already mapped; with numa, both buffers are first touched and then
+  // transitioned under the same static band-to-thread assignment
+  arma::cube A, B;
+  if (numa) {
+    A = placed_cube(N.n_rows, N.n_cols, N.n_slices);
+    B = placed_cube(N.n_rows, N.n_cols, N.n_slices);
+    A = N; // copied into the placed pages
+    N.reset();
+  } else {
+    A = std::move(N);
+    B.set_size(size(A));
+    advise_huge(B.memptr(), B.n_elem);
+  }
+  arma::cube *cur = &A, *nxt = &B;
+
+  // record into d, or encoded if requested
+  if (enc) {
+    enc->put(0, A.slice(record));
+  } else {
+    d.slice(0) = A.slice(record);
+  }
+  if (progress) {
+    progress->total[0] = accu(A.slice(record));
+    progress->occupied[0] = accu(A.slice(record) > 0);
+  }
+
+  for(arma::uword i = 0; i < nsteps; ++i){
+
+    if (progress && progress->cancel.load()) {
+      break;
+    }
+
+    BlockRNG gen(step_seed(seed, run, i, 2));
+
+    // scheduled events
+    for(arma::uword k = 0; k < ev.size(); ++k) {
+      if (ev[k].step != i + 1) {
+        continue;
+      }
+      if (ev[k].type == "mask") {
+        thin(*cur, ev[k].mask, rand, gen);
+      } else if (ev[k].type == "alpha") {
+        alpha = ev[k].alpha;
+      } else if (ev[k].type == "fecundity") {
+        fecundity = ev[k].fecundity;
+      } else if (ev[k].type == "habitat") {
+        habitat.set_size(size(*cur));
+        for(arma::uword c = 0; c < cur->n_slices; ++c) {
+          habitat.slice(c) = ev[k].habitat;
+        }
+      }
+    }
+
+    transition_into(*cur, *cur, env(ei(i)), alpha, beta, gamma, rand, step_seed(seed, run, i, 0),
+                    link, terms, *nxt, numa);
+    arma::mat R; // dispersed seeds
+    if (numa) {
+      #pragma omp parallel
+      #pragma omp single
+      R = disperse_step(reproduce(*nxt, fecundity), nb, nbi, reflect, rand, step_seed(seed, run, i, 1));
+    } else {
+      R = disperse_step(reproduce(*nxt, fecundity), nb, nbi, reflect, rand, step_seed(seed, run, i, 1));
+    }
+    nxt->slice(0) += R;
+    std::swap(cur, nxt);
+
+    if (!habitat.is_empty()) {
+      thin(*cur, habitat, rand, gen);
+    }
+
+    const arma::cube &Y = *cur;
+    if (enc) {
+      enc->put(i + 1, Y.slice(record));
+    } else {
+      d.slice(i + 1) = Y.slice(record);
+    }
+
+    if (progress) {
+      progress->total[i + 1] = accu(Y.slice(record));
+      progress->occupied[i + 1] = accu(Y.slice(record) > 0);
+      progress->step.store(i + 1, std::memory_order_release);
+    }
+  }
+}
+
+
+//' Run a range simulation
+//'
+//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
+//' @param env A list of environmental data. Each element list element should be a 3-D array of dimensions (x, y, variable).
+//' The list should have one element for time-invariant environment, or \code{nsteps} elements for time-varying environment.
+//' @param alpha, \code{beta, gamma, fecundity} Demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' @param nb Neighborhood matrix; e.g. output from \code{neighborhood}.
+//' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
+//' @param seed Integer to seed random number generator.
+//' @param events A list of scheduled events, e.g. generated by \code{event()}. Events are applied at the start of their time step:
+//' masks multiply the population once, \code{alpha} and \code{fecundity} overrides remain in effect until overridden again,
+//' and habitat masks multiply the population at the end of every subsequent step.
+//' @param numa Place the state and environment buffers for large grids (Boolean, default = FALSE): each band of the grid
+//' is first touched, and then transitioned every step, by the same thread under a static assignment, so that its pages
+//' stay on that thread's NUMA node; transparent huge pages are requested where supported.
+//' @param link, \code{terms} Optional link functions and derived environmental terms; see \code{?transition}.
+//' @param encoding Output encoding (integer): 0 = double (default); 1 = float16, with relative error at most 2^-11 for
+//' values of at least 2^-14 (about 6.1e-5), and smaller values stored as zero; 2 = log-quantized 16-bit, with relative
+//' error at most \code{tol} for values from \code{tol} up to at least 1e9, which requires \code{tol} of about 2.2e-4 or
+//' more, and smaller values rounded to the nearer of zero and \code{tol}; 3 = 32-bit integer counts, exact, for randomized runs only. Values beyond an encoding's range are clamped, with
+//' a warning.
+//' @param tol Error bound for encoded output.
+//' @return A 3-D array of population numbers for the recorded class (x, y, time); for encoded output, a list of class
+//' \code{encoded_sim} with the encoded \code{data}, its \code{dim}, \code{encoding}, and \code{tol}, which
+//' \code{decode_output} expands.
+//' @export
+// [[Rcpp::export]]
+SEXP sim(arma::cube N,
+         arma::field<arma::cube> env,
+         arma::mat alpha,
+         arma::cube beta,
+         arma::cube gamma,
+         arma::vec fecundity,
+         arma::mat nb,
+         bool reflect = true,
+         bool rand = true,
+         int seed = 1,
+         int record = 0,
+         arma::uword nsteps = 100,
+         Rcpp::List events = Rcpp::List::create(),
+         bool numa = false,
+         Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+         Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue,
+         int encoding = 0,
+         double tol = 1e-3) {
+
+  std::vector<Event> ev = parse_events(events, N, nsteps);
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, env(0).n_slices, gamma);
+  check_sim(N, env, alpha, beta, gamma, fecundity, nb, tm, record, nsteps);
+  arma::uvec nbi = arma::sort_index(nb, "descent"); // order to evaluate neighbors
+
+  // large runs: place environment buffers band by band; the state is placed
+  // by sim_core
+  if (numa) {
+    for(arma::uword j = 0; j < env.n_elem; ++j) {
+      arma::cube x = placed_cube(env(j).n_rows, env(j).n_cols, env(j).n_slices);
+      x = env(j);
+      env(j) = std::move(x);
+    }
+  }
+
+  // compact output is recorded straight into an R raw vector; plain output
+  // into d, every slice of which is written
+  arma::uword nr = N.n_rows, nc = N.n_cols;
+  if (encoding == 3 && !rand) {
+    Rcpp::stop("count output needs a randomized run, whose values are whole numbers");
+  }
+  Codec codec(encoding, tol);
+  Rcpp::RawVector data;
+  std::unique_ptr<Encoded> enc;
+  arma::cube d;
+  if (encoding != 0) {
+    data = Rcpp::RawVector((R_xlen_t) (nr * nc * (nsteps + 1) * codec.bytes()));
+    enc.reset(new Encoded(codec, (char *) RAW(data)));
+  } else {
+    d.set_size(nr, nc, nsteps + 1);
+  }
+
+  if (numa) {
+    sim_core(std::move(N), env, alpha, beta, gamma, lk, tm, fecundity, nb, nbi, ev,
+             reflect, rand, seed, 0, record, nsteps, d, NULL, enc.get(), true);
+  } else {
+    #pragma omp parallel
+    #pragma omp single
+    sim_core(std::move(N), env, alpha, beta, gamma, lk, tm, fecundity, nb, nbi, ev,
+             reflect, rand, seed, 0, record, nsteps, d, NULL, enc.get());
+  }
+
+  if (enc) {
+    if (enc->clamped > 0) {
+      Rcpp::warning("%d recorded values exceeded the range of the output encoding and were clamped",
+                    (int) enc->clamped);
+    }
+    return encoded_list(data, nr, nc, nsteps + 1, codec);
+  }
+  return Rcpp::wrap(d);
+}
+
+
+// BACKGROUND SIMULATION ///////////////////////////////////////////////////////
+
+// a simulation running on its own thread, owning copies of all of its inputs
+struct Job {
+  arma::cube N;
+  arma::field<arma::cube> env;
+  arma::mat alpha;
+  arma::cube beta;
+  arma::cube gamma;
+  arma::imat link;
+  arma::umat terms;
+  arma::vec fecundity;
+  arma::mat nb;
+  arma::uvec nbi;
+  std::vector<Event> ev;
+  bool reflect;
+  bool rand;
+  int seed;
+  int record;
+  arma::uword nsteps;
+
+  arma::cube d;
+  Progress progress;
+  std::atomic<bool> done;
+  std::string error;
+  std::thread worker;
+
+  explicit Job(arma::uword nsteps) : progress(nsteps), done(false) {}
+
+  // inputs are checked by sim_async before the thread starts. only errors
+  // thrown on this thread, such as failing to allocate a step's buffers,
+  // are caught here, so that they do not leave the parallel region; an
+  // exception inside a band task cannot cross the task boundary and ends
+  // the process, so the memory a run needs is best checked with dry_run
+  void run() {
+    #pragma omp parallel
+    #pragma omp single
+    {
+      try {
+        sim_core(N, env, alpha, beta, gamma, link, terms, fecundity, nb, nbi, ev,
+                 reflect, rand, seed, 0, record, nsteps, d, &progress);
+      } catch (std::exception &e) {
+        error = e.what();
+      }
+    }
+    done.store(true);
+  }
+
+  // a handle collected by R stops the simulation
+  ~Job() {
+    progress.cancel.store(true);
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+};
+
+
+//' Start a range simulation in the background
+//'
+//' Runs the same simulation as \code{sim} on a background thread and returns immediately, leaving the
+//' R session responsive. Use \code{sim_poll}, \code{sim_cancel}, and \code{sim_wait} with the returned handle.
+//'
+//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
+//' @param env A list of environmental data, as in \code{sim}.
+//' @param alpha, \code{beta, gamma, fecundity} Demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' @param nb Neighborhood matrix; e.g. output from \code{neighborhood}.
+//' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
+//' @param seed Integer to seed random number generator.
+//' @param events A list of scheduled events, as in \code{sim}.
+//' @param link, \code{terms} Optional link functions and derived environmental terms; see \code{?transition}.
+//' @return An external pointer handle to the running simulation.
+//' @export
+// [[Rcpp::export]]
+SEXP sim_async(arma::cube N,
+               arma::field<arma::cube> env,
+               arma::mat alpha,
+               arma::cube beta,
+               arma::cube gamma,
+               arma::vec fecundity,
+               arma::mat nb,
+               bool reflect = true,
+               bool rand = true,
+               int seed = 1,
+               int record = 0,
+               arma::uword nsteps = 100,
+               Rcpp::List events = Rcpp::List::create(),
+               Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+               Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue) {
+
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, env(0).n_slices, gamma);
+  check_sim(N, env, alpha, beta, gamma, fecundity, nb, tm, record, nsteps);
+  std::vector<Event> ev = parse_events(events, N, nsteps);
+
+  std::unique_ptr<Job> job(new Job(nsteps)); // owned by the handle once wrapped
+  job->ev = std::move(ev);
+  job->nbi = arma::sort_index(nb, "descent"); // order to evaluate neighbors
+  job->d.zeros(N.n_rows, N.n_cols, nsteps + 1);
+  job->N = std::move(N);
+  job->env = std::move(env);
+  job->alpha = std::move(alpha);
+  job->beta = std::move(beta);
+  job->gamma = std::move(gamma);
+  job->link = std::move(lk);
+  job->terms = std::move(tm);
+  job->fecundity = std::move(fecundity);
+  job->nb = std::move(nb);
+  job->reflect = reflect;
+  job->rand = rand;
+  job->seed = seed;
+  job->record = record;
+  job->nsteps = nsteps;
+
+  Rcpp::XPtr<Job> handle(job.release(), true);
+  handle->worker = std::thread(&Job::run, handle.get());
+  return handle;
+}
+
+
+//' Check the progress of a background simulation
+//'
+//' @param job A handle returned by \code{sim_async}.
+//' @return A list with the number of completed \code{steps}, the total \code{nsteps}, whether the run is \code{done},
+//' and per-step reductions of the recorded class so far: \code{total} individuals and \code{occupied} cells.
+//' @export
+// [[Rcpp::export]]
+Rcpp::List sim_poll(SEXP job) {
+  Rcpp::XPtr<Job> j(job);
+  bool done = j->done.load();
+  arma::uword step = j->progress.step.load(std::memory_order_acquire);
+  std::vector<double> total(j->progress.total.begin(), j->progress.total.begin() + step + 1);
+  std::vector<double> occupied(j->progress.occupied.begin(), j->progress.occupied.begin() + step + 1);
+  return Rcpp::List::create(Rcpp::Named("steps") = (double) step,
+                            Rcpp::Named("nsteps") = (double) j->nsteps,
+                            Rcpp::Named("done") = done,
+                            Rcpp::Named("total") = total,
+                            Rcpp::Named("occupied") = occupied);
+}
+
+
+//' Cancel a background simulation
+//'
+//' The simulation stops at the end of its current time step; \code{sim_wait} then returns the steps completed so far.
+//'
+//' @param job A handle returned by \code{sim_async}.
+//' @export
+// [[Rcpp::export]]
+void sim_cancel(SEXP job) {
+  Rcpp::XPtr<Job> j(job);
+  j->progress.cancel.store(true);
+}
+
+
+//' Wait for a background simulation to finish
+//'
+//' Waiting can be interrupted from R without stopping the simulation.
+//'
+//' @param job A handle returned by \code{sim_async}.
+//' @return A 3-D array of population numbers of the recorded class (x, y, time), truncated to the completed
+//' time steps if the run was cancelled.
+//' @export
+// [[Rcpp::export]]
+arma::cube sim_wait(SEXP job) {
+  Rcpp::XPtr<Job> j(job);
+  while (!j->done.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    Rcpp::checkUserInterrupt();
+  }
+  if (j->worker.joinable()) {
+    j->worker.join();
+  }
+  if (!j->error.empty()) {
+    Rcpp::stop(j->error);
+  }
+  return j->d.slices(0, j->progress.step.load());
 }
 
 
-arma::icube rmultinom_trans(arma::mat pop,
-                            arma::cube probs,
-                            std::default_random_engine gen) {
+// OUT-OF-CORE SIMULATION //////////////////////////////////////////////////////
 
-  arma::imat popn = arma::conv_to<arma::imat>::from(pop);
-  arma::icube y(size(probs), arma::fill::zeros);
-  arma::mat p(size(pop), arma::fill::zeros);
-  arma::mat m = 1 - sum(probs, 2); // mortality
-  arma::imat u = popn; // unallocated
+// Output files hold a 64-byte header (magic, then rows, columns, time steps,
+// and encoding as 64-bit integers, then the error bound as a double),
+// followed by the recorded class as encoded (x, y, time) values in
+// column-major order. Zero is all-zero bytes in every encoding, so regions
+// never written read as zero.
+const size_t header_bytes = 64;
 
-  for(arma::uword i = 0; i < probs.n_slices; ++i) {
-    p = sum(probs.slices(i, probs.n_slices - 1), 2);
-    y.slice(i) = arma::min(rbinom_trans(u, probs.slice(i) / (p + m), gen), u);
-    u = u - y.slice(i);
-  }
+void write_header(char *h,
+                  arma::uword n_rows,
+                  arma::uword n_cols,
+                  arma::uword n_slices,
+                  const Codec &codec) {
+  uint64_t v[4] = {n_rows, n_cols, n_slices, (uint64_t) codec.type};
+  std::memcpy(h, "STRANGER", 8);
+  std::memcpy(h + 8, v, sizeof(v));
+  std::memcpy(h + 40, &codec.tol, sizeof(double));
+}
 
-  return(y);
+#ifndef _WIN32
+
+// encode columns c0..c1 of x as time step i of a mapped output file and
+// write them back, returning the number of clamped values
+arma::uword put_band(MappedFile &out,
+                     const Codec &codec,
+                     const arma::mat &x,
+                     arma::uword i,
+                     arma::uword c0,
+                     arma::uword c1) {
+  size_t n = (c1 - c0 + 1) * x.n_rows;
+  char *y = out.data() + header_bytes + (i * x.n_cols + c0) * x.n_rows * codec.bytes();
+  arma::uword clamped = codec.encode(x.colptr(c0), n, y);
+  out.release(y, y + n * codec.bytes());
+  return clamped;
 }
 
 
+// grid read from a file in the output format with double encoding, e.g. one
+// written by write_grid(); x views the read-only mapping, and must not be
+// written
+class MappedGrid : public MappedFile {
+public:
+  arma::cube x;
 
-//' Perform a stage-based demographic transition
+  explicit MappedGrid(const std::string &path) :
+    MappedFile(path),
+    x((double *) (data() + header_bytes), field(path, 0), field(path, 1), field(path, 2), false, true) {}
+
+  // drop columns c0..c1 of all slices once read
+  void release(arma::uword c0, arma::uword c1) {
+    for(arma::uword j = 0; j < x.n_slices; ++j) {
+      MappedFile::release(x.slice(j).colptr(c0), x.slice(j).colptr(c1) + x.n_rows);
+    }
+  }
+
+private:
+  // header field j (rows, columns, slices), checked against the file
+  arma::uword field(const std::string &path,
+                    int j) {
+    uint64_t v[4];
+    if (size() < header_bytes || std::memcmp(data(), "STRANGER", 8) != 0) {
+      throw std::runtime_error("not a grid file: " + path);
+    }
+    std::memcpy(v, data() + 8, sizeof(v));
+    if (v[3] != 0 || size() < header_bytes + sizeof(double) * v[0] * v[1] * v[2]) {
+      throw std::runtime_error("grid file must hold all of its values as doubles: " + path);
+    }
+    return v[j];
+  }
+};
+
+
+// input grid, given either as a numeric array, viewed in place, or as the
+// path of a grid file, mapped read-only
+class GridInput {
+  std::unique_ptr<MappedGrid> file;
+  std::unique_ptr<arma::cube> view;
+  Rcpp::NumericVector values; // array values, protected while viewed
+
+public:
+  explicit GridInput(SEXP x) {
+    if (TYPEOF(x) == STRSXP) {
+      file.reset(new MappedGrid(Rcpp::as<std::string>(x)));
+      return;
+    }
+    SEXP dim = Rf_getAttrib(x, R_DimSymbol);
+    if (Rf_length(dim) != 3) {
+      Rcpp::stop("grids must be 3-D arrays or grid file paths");
+    }
+    Rcpp::IntegerVector d(dim);
+    values = Rcpp::NumericVector(x); // integer arrays are converted
+    view.reset(new arma::cube(values.begin(), d[0], d[1], d[2], false, true));
+  }
+
+  const arma::cube &x() const {
+    return file ? file->x : *view;
+  }
+
+  // drop columns c0..c1 of a mapped grid once read
+  void release(arma::uword c0, arma::uword c1) {
+    if (file) {
+      file->release(c0, c1);
+    }
+  }
+};
+
+#endif
+
+
+//' Run a range simulation out of core
 //'
-//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
-//' @param E A 3-D array of environmental data (x, y, variable).
-//' @param alpha A matrix of transition intercepts (to, from).
-//' @param beta A 3-D array of density dependence effects (to, from, modifier).
-//' @param gamma A 3-D array of environmental effects (to, from, variable).
+//' Runs the same simulation as \code{sim}, but keeps the stage state, seeds, and dispersed seeds in memory-mapped
+//' scratch files and writes the recorded class to an output file rather than returning it. The initial state and
+//' environmental data can be given as grid files (see \code{write_grid()}), which are mapped read-only; arrays are read
+//' in place. The grid is processed in column bands, in order, and each band's pages are released once the band is done,
+//' so resident memory is bounded by the bands in flight. Bands without individuals or seeds are tracked with flags and
+//' never read. Results match \code{sim} for the same seed. Scheduled events are not supported. Not available on Windows.
+//'
+//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class), or the path of
+//' a grid file holding it.
+//' @param env A list of environmental data, as in \code{sim}, whose elements may also be paths of grid files.
+//' @param alpha, \code{beta, gamma, fecundity} Demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' @param nb Neighborhood matrix; e.g. output from \code{neighborhood}.
+//' @param path Output file, readable with \code{read_sim()}. Scratch files are created alongside it.
 //' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
 //' @param seed Integer to seed random number generator.
-//' @return A 3-D array of population numbers for each life stage.
+//' @param link, \code{terms} Optional link functions and derived environmental terms; see \code{?transition}.
+//' @param encoding, \code{tol} Output encoding and error bound, as in \code{sim}.
+//' @return The output file path.
 //' @export
 // [[Rcpp::export]]
-arma::cube transition(arma::cube N,
-                      arma::cube E,
-                      arma::mat alpha,
-                      arma::cube beta,
-                      arma::cube gamma,
-                      bool rand = true,
-                      int seed = 1) {
+std::string sim_file(SEXP N,
+                     Rcpp::List env,
+                     arma::mat alpha,
+                     arma::cube beta,
+                     arma::cube gamma,
+                     arma::vec fecundity,
+                     arma::mat nb,
+                     std::string path,
+                     bool reflect = true,
+                     bool rand = true,
+                     int seed = 1,
+                     int record = 0,
+                     arma::uword nsteps = 100,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue,
+                     int encoding = 0,
+                     double tol = 1e-3) {
 
-  arma::cube NN(size(N), arma::fill::zeros);
-  arma::cube p(size(N), arma::fill::zeros);
-  double m = 0;
+#ifdef _WIN32
+  Rcpp::stop("out-of-core simulation is not supported on Windows");
+#else
 
-  std::default_random_engine gen(seed); // initialize random number generator
+  GridInput n0(N);
+  const arma::cube &X = n0.x();
+  arma::uword nr = X.n_rows, nc = X.n_cols, nk = X.n_slices;
+  if (env.size() == 0 || (env.size() > 1 && (arma::uword) env.size() < nsteps)) {
+    Rcpp::stop("env must have one element, or one per time step");
+  }
+  std::vector< std::unique_ptr<GridInput> > e;
+  for(int j = 0; j < env.size(); ++j) {
+    SEXP ej = env[j];
+    e.emplace_back(new GridInput(ej));
+    check_layer(e[j]->x(), nr, nc, e[0]->x().n_slices);
+  }
+  arma::uword ne = e[0]->x().n_slices;
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, ne, gamma);
+  check_demography(alpha, beta, gamma, nk, nk, ne + tm.n_rows);
+  check_fecundity(fecundity, nk);
+  check_neighborhood(nb);
+  check_record(record, nk);
+  arma::uvec nbi = arma::sort_index(nb, "descent"); // order to evaluate neighbors
 
-  for(arma::uword s = 0; s < alpha.n_cols; ++s) { // source class
+  arma::vec ei(nsteps + 1, arma::fill::zeros);
+  if (e.size() > 1) {
+    ei = arma::linspace(0, nsteps, nsteps + 1);
+  }
 
-    p.fill(0);
+  // transition bands match transition_into, and dispersal bands
+  // disperse_step, for identical results
+  arma::uword w = band_width(0);
+  int nband = n_bands(nc, w);
+  int r = (nb.n_rows - 1) / 2; // window radius
+  arma::uword wd = band_width(r);
+  int ndband = n_bands(nc, wd);
 
-    // construct transition probabilities
-    for(arma::uword t = 0; t < alpha.n_rows; ++t) { // target class
+  if (encoding == 3 && !rand) {
+    Rcpp::stop("count output needs a randomized run, whose values are whole numbers");
+  }
+  Codec codec(encoding, tol);
+  MappedFile out(path, header_bytes + nr * nc * (nsteps + 1) * codec.bytes(), true);
+  write_header(out.data(), nr, nc, nsteps + 1, codec);
+  arma::uword clamped = 0;
+  MappedCube sa(path + ".a", nr, nc, nk), sb(path + ".b", nr, nc, nk); // state
+  MappedCube *cur = &sa, *nxt = &sb;
+  MappedCube sfile(path + ".s", nr, nc, 1); // seeds
+  MappedCube tfile(path + ".t", nr + r * 2, nc + r * 2, 1); // dispersed seeds, padded
+  arma::mat &S = sfile.x.slice(0);
+  arma::mat &T = tfile.x.slice(0);
 
-      if (alpha(t, s) +
-          accu(beta.tube(t, s)) +
-          accu(gamma.tube(t, s)) == 0) {
-        continue;
-      }
+  // per transition band: any individuals in the current and next state, any
+  // seeds produced, nonzero values left in S, and dispersed seeds to settle;
+  // per dispersal band: seeds scattered
+  std::vector<char> occ(nband), nocc(nband), seeded(nband), sset(nband), settle(nband);
+  std::vector<char> scattered(ndband);
 
-      // intercept
-      p.slice(t).fill(alpha(t, s));
+  for(int k = 0; k < nband; ++k) {
+    arma::uword c0 = k * w;
+    arma::uword c1 = std::min(c0 + w, nc) - 1;
+    occ[k] = accu(X.cols(c0, c1)) > 0;
+    if (occ[k]) {
+      cur->x.cols(c0, c1) = X.cols(c0, c1);
+      cur->release(c0, c1);
+      clamped += put_band(out, codec, X.slice(record), 0, c0, c1);
+    }
+    n0.release(c0, c1);
+  }
 
-      // density dependence
-      for(arma::uword d = 0; d < N.n_slices; ++d){
-        m = beta(t, s, d);
-        if (m != 0) {
-          p.slice(t) = p.slice(t) + arma::conv_to<arma::mat>::from(N.slice(d)) * m;
+  #pragma omp parallel
+  #pragma omp single
+  for(arma::uword i = 0; i < nsteps; ++i){
+
+    GridInput &gi = *e[(arma::uword) ei(i)];
+    const arma::cube &E = gi.x();
+
+    // transition and reproduction
+    #pragma omp taskloop default(shared) grainsize(1)
+    for(int k = 0; k < nband; ++k) {
+      arma::uword c0 = k * w;
+      arma::uword c1 = std::min(c0 + w, nc) - 1;
+      if (!occ[k]) {
+        nocc[k] = 0;
+        seeded[k] = 0;
+        if (sset[k]) {
+          S.cols(c0, c1).zeros();
+          sfile.release(c0, c1);
+          sset[k] = 0;
         }
+        continue;
+      }
+      if (k + 1 < nband && occ[k + 1]) {
+        cur->prefetch(c1 + 1, std::min(c1 + w, nc - 1));
+      }
+      arma::cube Nb = cur->x.cols(c0, c1);
+      arma::cube NNb = transition_tile(Nb, Nb, E.cols(c0, c1), alpha, beta, gamma,
+                                       rand, step_seed(seed, 0, i, 0), k, lk, tm);
+      S.cols(c0, c1) = reproduce(NNb, fecundity);
+      seeded[k] = sset[k] = accu(S.cols(c0, c1)) > 0;
+      sfile.release(c0, c1);
+      nocc[k] = accu(NNb) > 0;
+      if (nocc[k]) {
+        nxt->x.cols(c0, c1) = NNb;
+        nxt->release(c0, c1);
       }
+      cur->release(c0, c1);
+      gi.release(c0, c1);
+    }
 
-      // environmental dependence
-      for(arma::uword e = 0; e < E.n_slices; ++e){
-        m = gamma(t, s, e);
-        if (m != 0) {
-          p.slice(t) = p.slice(t) + E.slice(e) * m;
+    // dispersal, in the even and odd phases of disperse_step; dispersal bands
+    // whose columns hold no seeds are skipped
+    uint64_t sd = step_seed(seed, 0, i, 1);
+    for(int phase = 0; phase < 2; ++phase) {
+      #pragma omp taskloop default(shared) grainsize(1)
+      for(int k = phase; k < ndband; k += 2) {
+        arma::uword c0 = k * wd;
+        arma::uword c1 = std::min(c0 + wd, nc) - 1;
+        scattered[k] = 0;
+        for(arma::uword b = c0 / w; b <= c1 / w; ++b) {
+          scattered[k] = scattered[k] || seeded[b];
         }
+        if (!scattered[k]) {
+          continue;
+        }
+        scatter_band(S, nb, nbi, rand, sd, k, c0, c1, T);
+        sfile.release(c0, c1);
+        tfile.release(c0, c1 + r * 2);
       }
+    }
 
+    // transition bands reached by any dispersal window
+    bool any = false;
+    std::fill(settle.begin(), settle.end(), 0);
+    for(int k = 0; k < ndband; ++k) {
+      if (!scattered[k]) {
+        continue;
+      }
+      any = true;
+      long a = (long) (k * wd) - r;
+      long b = (long) std::min((k + 1) * wd, nc) - 1 + r;
+      for(long c = std::max(a, 0L) / w; c <= std::min(b, (long) nc - 1) / (long) w; ++c) {
+        settle[c] = 1;
+      }
+    }
+    if (any && reflect) {
+      fold_cols(T, r);
     }
 
-    // constrain individual and joint probabilities
-    p = clamp(p, 0, 1);
-    arma::mat psum = sum(p, 2);
-    for(arma::uword x = 0; x < psum.n_rows; ++x) {
-      for(arma::uword y = 0; y < psum.n_cols; ++y) {
-        if(psum(x, y) > 1) {
-          p.tube(x, y) = p.tube(x, y) / psum(x, y);
+    // settle dispersed seeds, clear them from T, and record
+    #pragma omp taskloop default(shared) grainsize(1)
+    for(int k = 0; k < nband; ++k) {
+      arma::uword c0 = k * w;
+      arma::uword c1 = std::min(c0 + w, nc) - 1;
+      bool seeds = false;
+      if (settle[k]) {
+        if (reflect) {
+          fold_rows(T, r, c0 + r, c1 + r);
+        }
+        seeds = accu(T.submat(r, c0 + r, r + nr - 1, c1 + r)) > 0;
+      }
+      if (seeds) {
+        if (!nocc[k]) {
+          nxt->x.cols(c0, c1).zeros();
+          nocc[k] = 1;
         }
+        nxt->x.slice(0).cols(c0, c1) += T.submat(r, c0 + r, r + nr - 1, c1 + r);
+      }
+      if (settle[k]) {
+        T.cols(c0 + r, c1 + r).zeros();
+        tfile.release(c0 + r, c1 + r);
       }
+      if (!nocc[k]) {
+        continue; // left as zeros in the output file
+      }
+      arma::uword c = put_band(out, codec, nxt->x.slice(record), i + 1, c0, c1);
+      #pragma omp atomic
+      clamped += c;
+      nxt->release(c0, c1);
     }
 
-    // perform class transition
-    if (rand) {
-      NN = NN + rmultinom_trans(N.slice(s), p, gen);
-      ++seed;
-    } else {
-      for(arma::uword t = 0; t < alpha.n_rows; ++t) {
-        NN.slice(t) = NN.slice(t) + N.slice(s) % p.slice(t);
-      }
+    // padding columns are not settled by any band
+    if (any && r > 0) {
+      T.cols(0, r - 1).zeros();
+      T.cols(T.n_cols - r, T.n_cols - 1).zeros();
+      tfile.release(0, r - 1);
+      tfile.release(T.n_cols - r, T.n_cols - 1);
     }
 
+    std::swap(cur, nxt);
+    occ.swap(nocc);
   }
 
-  return NN;
+  msync(out.data(), header_bytes, MS_SYNC);
+  if (clamped > 0) {
+    Rcpp::warning("%d recorded values exceeded the range of the output encoding and were clamped",
+                  (int) clamped);
+  }
+  return path;
+#endif
 }
 
 
-//' Reproduction across a spatial grid
+//' Run a multi-species community simulation
 //'
-//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
-//' @param f Integer vector of fecundity with a value for each class in \code{N}.
-//' @return A matrix.
+//' All species share the same landscape and environmental data, and advance in lockstep.
+//' Interspecific density dependence enters through \code{beta}, whose third dimension spans
+//' the classes of all species, in the order in which the species are listed.
+//'
+//' @param N A list with one 3-D array of population numbers per species (x, y, class).
+//' @param env A list of environmental data, as in \code{sim}.
+//' @param alpha, \code{gamma, fecundity} Lists of per-species demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' @param beta A list of per-species density dependence arrays (to, from, modifier), where modifiers are the classes of all species.
+//' @param nb A list of per-species neighborhood matrices.
+//' @param record Integer vector giving the index (0-based) of the class to record for each species.
+//' @param seed Integer to seed random number generator.
+//' @return A list with one 3-D array per species, holding population numbers of its recorded class (x, y, time).
 //' @export
 // [[Rcpp::export]]
-arma::mat reproduce(arma::cube N,
-                    arma::vec f) {
-  arma::mat y(N.n_rows, N.n_cols, arma::fill::zeros);
+arma::field<arma::cube> sim_community(arma::field<arma::cube> N,
+                                      arma::field<arma::cube> env,
+                                      arma::field<arma::mat> alpha,
+                                      arma::field<arma::cube> beta,
+                                      arma::field<arma::cube> gamma,
+                                      arma::field<arma::vec> fecundity,
+                                      arma::field<arma::mat> nb,
+                                      arma::uvec record,
+                                      bool reflect = true,
+                                      bool rand = true,
+                                      int seed = 1,
+                                      arma::uword nsteps = 100) {
 
-  for(arma::uword i = 0; i < N.n_slices; ++i){
-    if (f(i) == 0) {
-      continue;
+  int ns = N.n_elem; // number of species
+  arma::uword n = N.n_elem;
+  if (n == 0 || alpha.n_elem != n || beta.n_elem != n || gamma.n_elem != n ||
+      fecundity.n_elem != n || nb.n_elem != n || record.n_elem != n) {
+    Rcpp::stop("N, alpha, beta, gamma, fecundity, nb, and record must have one element per species");
+  }
+  arma::uword nc = 0; // number of classes across all species
+  for(int k = 0; k < ns; ++k) {
+    nc += N(k).n_slices;
+  }
+  check_env(env, N(0).n_rows, N(0).n_cols, nsteps);
+  for(int k = 0; k < ns; ++k) {
+    if (N(k).n_rows != N(0).n_rows || N(k).n_cols != N(0).n_cols) {
+      Rcpp::stop("all species must share the same spatial grid");
     }
-    y = y + N.slice(i) * f(i);
+    if (beta(k).n_slices != nc) {
+      Rcpp::stop("beta must have one modifier per class across all species");
+    }
+    check_demography(alpha(k), beta(k), gamma(k), N(k).n_slices, nc, env(0).n_slices);
+    check_fecundity(fecundity(k), N(k).n_slices);
+    check_neighborhood(nb(k));
+    check_record(record(k), N(k).n_slices);
   }
 
-  return(y);
-}
-
-
-// DISPERSAL ///////////////////////////////////////////////////////////////////
+  arma::vec ei(nsteps + 1, arma::fill::zeros);
+  if (env.n_elem > 1) {
+    ei = arma::linspace(0, nsteps, nsteps + 1);
+  }
 
+  arma::field<arma::cube> d(ns);
+  for(int k = 0; k < ns; ++k) {
+    d(k).zeros(N(0).n_rows, N(0).n_cols, nsteps + 1);
+    d(k).slice(0) = N(k).slice(record(k));
+  }
 
-int rbinom_disp(int n,
-                double p,
-                std::default_random_engine gen) {
-  std::binomial_distribution<> d(n, p);
-  return d(gen);
-}
+  arma::field<arma::uvec> nbi(ns); // order to evaluate neighbors
+  for(int k = 0; k < ns; ++k) {
+    nbi(k) = arma::sort_index(nb(k), "descent");
+  }
 
+  arma::cube D(N(0).n_rows, N(0).n_cols, nc); // densities of all classes
 
-arma::imat rmultinom_disp(int seeds,
-                          arma::mat probs,
-                          arma::uvec ind,
-                          std::default_random_engine gen) {
+  #pragma omp parallel
+  #pragma omp single
+  for(arma::uword i = 0; i < nsteps; ++i){
 
-  arma::imat y(size(probs), arma::fill::zeros); // post-dispersal counts
-  double p = 1; // unallocated probability
-  int u = seeds; // unallocated seeds
-  arma::uword ii = 0;
+    arma::uword c = 0;
+    for(int k = 0; k < ns; ++k) {
+      D.slices(c, c + N(k).n_slices - 1) = N(k);
+      c += N(k).n_slices;
+    }
+    const arma::cube &E = env(ei(i));
 
-  for(arma::uword i = 0; i < probs.n_elem; ++i) {
-    ii = ind(i);
-    p = accu(probs);
-    y(ii) = std::min(rbinom_disp(u, probs(ii) / p, gen), u);
-    u = u - y(ii);
-    if (u == 0) {
-      break;
+    for(int k = 0; k < ns; ++k) {
+      #pragma omp task default(shared) firstprivate(k)
+      {
+        N(k) = transition_step(N(k), D, E, alpha(k), beta(k), gamma(k), rand,
+                               step_seed(seed, k, i, 0));
+        N(k).slice(0) = N(k).slice(0) + disperse_step(reproduce(N(k), fecundity(k)), nb(k), nbi(k),
+                                                      reflect, rand, step_seed(seed, k, i, 1));
+        d(k).slice(i + 1) = N(k).slice(record(k));
+      }
     }
-    probs(ii) = 0;
+    #pragma omp taskwait
   }
 
-  return(y);
+  return(d);
 }
 
 
-//' Simulate dispersal across a spatial grid
+//' Run range simulations across a batch of independent landscapes
 //'
-//' @param S A matrix of seed counts across a spatial grid.
-//' @param N A neighbor matrix, e.g. produced by \code{neighborhood()}.
-//' @param reflect Should dispersers exit the domain (\code{FALSE}) or bounce off the domain boundary (\code{TRUE}, default)?
-//' @param rand Randomize dispersal? (default = \code{TRUE})
-//' @param seed Integer to seed random number generator.
-//' @return A matrix of post-dispersal seed counts of the same dimension as \code{S}.
+//' All landscapes share the same species parameters and neighborhood matrix, which are
+//' prepared once; the landscapes are then simulated in parallel.
+//'
+//' @param N A list with one 3-D array of population numbers per landscape (x, y, class).
+//' @param env A list with one element per landscape, each a list of environmental data as in \code{sim}.
+//' @param alpha, \code{beta, gamma, fecundity} Demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' @param nb Neighborhood matrix; e.g. output from \code{neighborhood}.
+//' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
+//' @param seed Integer to seed random number generator; each landscape draws from its own streams.
+//' @param link, \code{terms} Optional link functions and derived environmental terms; see \code{?transition}.
+//' @return A list with one 3-D array per landscape, holding population numbers of the recorded class (x, y, time).
 //' @export
 // [[Rcpp::export]]
-arma::mat disperse(arma::mat S,
-                   arma::mat N,
-                   bool reflect = true,
-                   bool rand = true,
-                   int seed = 1) {
-
-  std::default_random_engine gen(seed); // initialize random number generator
-
-  arma::uvec Ni = arma::sort_index(N, "descent"); // order to evaluate neighbors
+arma::field<arma::cube> sim_batch(arma::field<arma::cube> N,
+                                  Rcpp::List env,
+                                  arma::mat alpha,
+                                  arma::cube beta,
+                                  arma::cube gamma,
+                                  arma::vec fecundity,
+                                  arma::mat nb,
+                                  bool reflect = true,
+                                  bool rand = true,
+                                  int seed = 1,
+                                  int record = 0,
+                                  arma::uword nsteps = 100,
+                                  Rcpp::Nullable<Rcpp::IntegerMatrix> link = R_NilValue,
+                                  Rcpp::Nullable<Rcpp::IntegerMatrix> terms = R_NilValue) {
 
-  int r = (N.n_rows - 1) / 2; // window radius
-  arma::mat T(S.n_rows + r * 2, S.n_cols + r * 2, arma::fill::zeros); // padded grid
-
-  for(arma::uword a = 0; a < S.n_rows; ++a) {
-    for(arma::uword b = 0; b < S.n_cols; ++b) {
+  int nl = N.n_elem; // number of landscapes
+  if (nl == 0 || env.size() != nl) {
+    Rcpp::stop("env must have one element per landscape");
+  }
 
-      if (rand) {
-        T.submat(a, b, a + r * 2, b + r * 2) =
-          T.submat(a, b, a + r * 2, b + r * 2) +
-          rmultinom_disp(S(a, b), N, Ni, gen);
-      } else {
-        T.submat(a, b, a + r * 2, b + r * 2) =
-          T.submat(a, b, a + r * 2, b + r * 2) +
-          S(a, b) * N;
-      }
+  // convert and check all inputs up front, outside the parallel region
+  std::vector< arma::field<arma::cube> > e(nl);
+  for(int b = 0; b < nl; ++b) {
+    e[b] = Rcpp::as< arma::field<arma::cube> >(env[b]);
+  }
+  std::vector<Event> ev;
+  arma::uvec nbi = arma::sort_index(nb, "descent"); // order to evaluate neighbors
+  arma::imat lk = parse_link(link, alpha);
+  arma::umat tm = parse_terms(terms, e[0](0).n_slices, gamma);
+  for(int b = 0; b < nl; ++b) {
+    check_sim(N(b), e[b], alpha, beta, gamma, fecundity, nb, tm, record, nsteps);
+  }
 
-    }
+  arma::field<arma::cube> d(nl);
+  for(int b = 0; b < nl; ++b) {
+    d(b).zeros(N(b).n_rows, N(b).n_cols, nsteps + 1);
   }
 
-  if (reflect) {
-    for(int i = 0; i < r; ++i){
-      T.row(r * 2 - 1 - i) = T.row(r * 2 - 1 - i) + T.row(i);
-      T.col(r * 2 - 1 - i) = T.col(r * 2 - 1 - i) + T.col(i);
-      T.row(T.n_rows - (r * 2 - 1 - i) - 1) =
-        T.row(T.n_rows - (r * 2 - 1 - i) - 1) + T.row(T.n_rows - 1 - i);
-      T.col(T.n_cols - (r * 2 - 1 - i) - 1) =
-        T.col(T.n_cols - (r * 2 - 1 - i) - 1) + T.col(T.n_cols - 1 - i);
-    }
+  #pragma omp parallel
+  #pragma omp single
+  for(int b = 0; b < nl; ++b) {
+    #pragma omp task default(shared) firstprivate(b)
+    sim_core(N(b), e[b], alpha, beta, gamma, lk, tm, fecundity, nb, nbi, ev,
+             reflect, rand, seed, b, record, nsteps, d(b));
   }
 
-  return T.submat(r, r, S.n_rows + r - 1, S.n_cols + r - 1);
+  return(d);
 }
 
 
-
-// SIMULATION //////////////////////////////////////////////////////////////////
-
-//' Run a range simulation
+//' Run a deterministic parameter sweep
 //'
-//' @param N A 3-D array of population numbers for each life stage, over a spatial grid (x, y, class).
-//' @param env A list of environmental data. Each element list element should be a 3-D array of dimensions (x, y, variable).
-//' The list should have one element for time-invariant environment, or \code{nsteps} elements for time-varying environment.
-//' @param alpha, \code{beta, gamma, fecundity} Demographic parameters; see \code{?transition} and \code{?reproduce}.
+//' Simulates several variants of the species parameters on the same landscape in a single
+//' deterministic run. State is stored with the variants as the innermost (contiguous) dimension,
+//' so each sweep over the grid reads the environmental data and neighborhood weights once and
+//' advances all variants together; variant counts that are a multiple of the SIMD width (4, 8 or 16)
+//' vectorize fully.
+//'
+//' @param N A 3-D array of initial population numbers for each life stage (x, y, class), shared by all variants.
+//' @param env A list of environmental data, as in \code{sim}.
+//' @param alpha, \code{beta, gamma, fecundity} Lists with one set of demographic parameters per variant; see \code{?transition} and \code{?reproduce}.
 //' @param nb Neighborhood matrix; e.g. output from \code{neighborhood}.
-//' @param rand Randomize transitions instead of using matrix multiplication? (Boolean, default = TRUE).
-//' @param seed Integer to seed random number generator.
-//' @return A 3-D array of population numbers for each life stage.
+//' @param record Index (0-based) of the class to record.
+//' @return A list with one 3-D array per variant, holding population numbers of the recorded class (x, y, time).
 //' @export
 // [[Rcpp::export]]
-arma::cube sim(arma::cube N,
-               arma::field<arma::cube> env,
-               arma::mat alpha,
-               arma::cube beta,
-               arma::cube gamma,
-               arma::vec fecundity,
-               arma::mat nb,
-               bool reflect = true,
-               bool rand = true,
-               int seed = 1,
-               int record = 0,
-               arma::uword nsteps = 100) {
+arma::field<arma::cube> sim_sweep(arma::cube N,
+                                  arma::field<arma::cube> env,
+                                  arma::field<arma::mat> alpha,
+                                  arma::field<arma::cube> beta,
+                                  arma::field<arma::cube> gamma,
+                                  arma::field<arma::vec> fecundity,
+                                  arma::mat nb,
+                                  bool reflect = true,
+                                  int record = 0,
+                                  arma::uword nsteps = 100) {
+
+  arma::uword W = alpha.n_elem; // number of variants (lanes)
+  arma::uword nr = N.n_rows, nc = N.n_cols, nk = N.n_slices;
+  arma::uword ncell = nr * nc;
+  arma::uword ne = env(0).n_slices;
+  if (W == 0 || beta.n_elem != W || gamma.n_elem != W || fecundity.n_elem != W) {
+    Rcpp::stop("alpha, beta, gamma, and fecundity must have one element per variant");
+  }
+  check_env(env, nr, nc, nsteps);
+  for(arma::uword w = 0; w < W; ++w) {
+    check_demography(alpha(w), beta(w), gamma(w), nk, nk, ne);
+    check_fecundity(fecundity(w), nk);
+  }
+  check_neighborhood(nb);
+  check_record(record, nk);
+
+  // parameter lanes: column (t, s[, modifier]) holds the W variant values
+  arma::mat A(W, nk * nk), F(W, nk);
+  arma::mat B(W, nk * nk * nk), G(W, nk * nk * ne);
+  for(arma::uword w = 0; w < W; ++w) {
+    for(arma::uword s = 0; s < nk; ++s) {
+      F(w, s) = fecundity(w)(s);
+      for(arma::uword t = 0; t < nk; ++t) {
+        A(w, t + nk * s) = alpha(w)(t, s);
+        for(arma::uword d = 0; d < nk; ++d) B(w, t + nk * (s + nk * d)) = beta(w)(t, s, d);
+        for(arma::uword e = 0; e < ne; ++e) G(w, t + nk * (s + nk * e)) = gamma(w)(t, s, e);
+      }
+    }
+  }
+
+  // transitions with a nonzero parameter in any variant
+  arma::umat active(nk, nk, arma::fill::zeros);
+  for(arma::uword s = 0; s < nk; ++s) {
+    for(arma::uword t = 0; t < nk; ++t) {
+      double a = accu(abs(A.col(t + nk * s)));
+      for(arma::uword d = 0; d < nk; ++d) a += accu(abs(B.col(t + nk * (s + nk * d))));
+      for(arma::uword e = 0; e < ne; ++e) a += accu(abs(G.col(t + nk * (s + nk * e))));
+      active(t, s) = a != 0;
+    }
+  }
 
   arma::vec ei(nsteps + 1, arma::fill::zeros);
   if (env.n_elem > 1) {
     ei = arma::linspace(0, nsteps, nsteps + 1);
   }
 
-  arma::cube d(N.n_rows, N.n_cols, nsteps + 1, arma::fill::zeros);
-  d.slice(0) = N.slice(record);
+  // lane-major state (variant, cell, class)
+  arma::cube X(W, ncell, nk);
+  for(arma::uword k = 0; k < nk; ++k) {
+    for(arma::uword c = 0; c < ncell; ++c) {
+      X.slice(k).col(c).fill(N.slice(k)(c));
+    }
+  }
+  arma::cube XX(W, ncell, nk);
+
+  int r = (nb.n_rows - 1) / 2; // window radius
+  arma::uword pr = nr + r * 2, pc = nc + r * 2; // padded grid
+  arma::mat S(W, ncell), T(W, pr * pc);
+
+  arma::field<arma::cube> d(W);
+  for(arma::uword w = 0; w < W; ++w) {
+    d(w).zeros(nr, nc, nsteps + 1);
+    d(w).slice(0) = N.slice(record);
+  }
 
   for(arma::uword i = 0; i < nsteps; ++i){
-    N = transition(N, env(ei(i)), alpha, beta, gamma, rand, seed * i);
-    N.slice(0) = N.slice(0) + disperse(reproduce(N, fecundity), nb, reflect, rand, seed * i + 1);
-    d.slice(i + 1) = N.slice(record);
+
+    const arma::cube &E = env(ei(i));
+    XX.zeros();
+
+    // demographic transition and reproduction, one cell at a time across all lanes
+    #pragma omp parallel
+    {
+      arma::mat p(W, nk);
+      arma::vec psum(W);
+      double *ps = psum.memptr();
+
+      #pragma omp for schedule(static)
+      for(arma::uword c = 0; c < ncell; ++c) {
+
+        double *s_out = S.colptr(c);
+        for(arma::uword w = 0; w < W; ++w) s_out[w] = 0;
+
+        for(arma::uword s = 0; s < nk; ++s) {
+
+          p.zeros();
+          psum.zeros();
+          for(arma::uword t = 0; t < nk; ++t) {
+            if (!active(t, s)) {
+              continue;
+            }
+            double *pt = p.colptr(t);
+            const double *a = A.colptr(t + nk * s);
+            #pragma omp simd
+            for(arma::uword w = 0; w < W; ++w) pt[w] = a[w];
+            for(arma::uword dd = 0; dd < nk; ++dd) {
+              const double *b = B.colptr(t + nk * (s + nk * dd));
+              const double *x = X.slice(dd).colptr(c);
+              #pragma omp simd
+              for(arma::uword w = 0; w < W; ++w) pt[w] += b[w] * x[w];
+            }
+            for(arma::uword e = 0; e < ne; ++e) {
+              const double *g = G.colptr(t + nk * (s + nk * e));
+              double v = E(c + ncell * e); // shared by all lanes
+              #pragma omp simd
+              for(arma::uword w = 0; w < W; ++w) pt[w] += g[w] * v;
+            }
+            #pragma omp simd
+            for(arma::uword w = 0; w < W; ++w) {
+              pt[w] = std::min(std::max(pt[w], 0.0), 1.0);
+              ps[w] += pt[w];
+            }
+          }
+
+          const double *x = X.slice(s).colptr(c);
+          for(arma::uword t = 0; t < nk; ++t) {
+            if (!active(t, s)) {
+              continue;
+            }
+            const double *pt = p.colptr(t);
+            double *y = XX.slice(t).colptr(c);
+            #pragma omp simd
+            for(arma::uword w = 0; w < W; ++w) {
+              y[w] += x[w] * (ps[w] > 1 ? pt[w] / ps[w] : pt[w]);
+            }
+          }
+        }
+
+        for(arma::uword k = 0; k < nk; ++k) {
+          const double *f = F.colptr(k);
+          const double *y = XX.slice(k).colptr(c);
+          #pragma omp simd
+          for(arma::uword w = 0; w < W; ++w) s_out[w] += f[w] * y[w];
+        }
+      }
+    }
+
+    // dispersal, gathered into each padded cell from the sources in its window
+    #pragma omp parallel for schedule(static)
+    for(arma::uword y = 0; y < pc; ++y) {
+      for(arma::uword x = 0; x < pr; ++x) {
+        double *t_out = T.colptr(x + pr * y);
+        for(arma::uword w = 0; w < W; ++w) t_out[w] = 0;
+        for(int bj = 0; bj <= r * 2; ++bj) {
+          long b = (long) y - bj;
+          if (b < 0 || b >= (long) nc) continue;
+          for(int bi = 0; bi <= r * 2; ++bi) {
+            long a = (long) x - bi;
+            if (a < 0 || a >= (long) nr) continue;
+            double m = nb(bi, bj);
+            if (m == 0) continue;
+            const double *s_in = S.colptr(a + nr * b);
+            #pragma omp simd
+            for(arma::uword w = 0; w < W; ++w) t_out[w] += m * s_in[w];
+          }
+        }
+      }
+    }
+
+    if (reflect) {
+      for(int k = 0; k < r; ++k){
+        for(arma::uword y = 0; y < pc; ++y) {
+          T.col(r * 2 - 1 - k + pr * y) += T.col(k + pr * y);
+          T.col(pr - (r * 2 - 1 - k) - 1 + pr * y) += T.col(pr - 1 - k + pr * y);
+        }
+        for(arma::uword x = 0; x < pr; ++x) {
+          T.col(x + pr * (r * 2 - 1 - k)) += T.col(x + pr * k);
+          T.col(x + pr * (pc - (r * 2 - 1 - k) - 1)) += T.col(x + pr * (pc - 1 - k));
+        }
+      }
+    }
+
+    for(arma::uword b = 0; b < nc; ++b) {
+      for(arma::uword a = 0; a < nr; ++a) {
+        XX.slice(0).col(a + nr * b) += T.col(a + r + pr * (b + r));
+      }
+    }
+
+    std::swap(X, XX);
+    for(arma::uword w = 0; w < W; ++w) {
+      for(arma::uword c = 0; c < ncell; ++c) {
+        d(w).slice(i + 1)(c) = X(w, c, record);
+      }
+    }
   }
 
   return(d);